@@ -0,0 +1,626 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <math.h>
+#if defined(HAVE_CLOCK_GETTIME) || defined(HAVE_GETHRTIME)
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+#if defined(HAVE_LINUX_PERF_EVENT_H) && defined(HAVE_SYS_SYSCALL_H)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __NR_perf_event_open
+#define BENCH_PERF 1
+#endif
+#endif
+#include "hashtable.h"
+
+// Every result is printed as one JSON object per line, so the output can be
+// diffed against a previous run or fed straight into a metrics pipeline.
+
+#define BENCH_MAX_SIZES 16
+#define BENCH_MIN_OPS (1 << 20)
+#define BENCH_BATCH 16
+#define BENCH_ZIPF_THETA 0.99
+#define BENCH_LONG_KEY_PREFIX "benchmark/tenant-0000/namespace/feature-dictionary/routing/"
+
+typedef enum {
+    BENCH_UNIFORM,
+    BENCH_ZIPF
+} bench_dist;
+
+typedef struct {
+    size_t count;
+    char **keys;
+    char *blob;
+} bench_keys;
+
+static uint64_t bench_rng_state;
+static bool bench_async_expand;
+static bool bench_bloom_filter;
+static size_t bench_hugepage_size;
+static size_t bench_threads;
+// data TLB misses counter, -1 when not available
+static int bench_tlb_fd = -1;
+
+static uint64_t bench_rand() {
+    // xorshift64*
+    bench_rng_state ^= bench_rng_state >> 12;
+    bench_rng_state ^= bench_rng_state << 25;
+    bench_rng_state ^= bench_rng_state >> 27;
+    return bench_rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t bench_now_ns() {
+#if defined(HAVE_CLOCK_GETTIME)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#elif defined(HAVE_GETHRTIME)
+    return gethrtime();
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+static const char *bench_timer_name() {
+#if defined(HAVE_CLOCK_GETTIME)
+    return "clock_gettime";
+#elif defined(HAVE_GETHRTIME)
+    return "gethrtime";
+#else
+    return "gettimeofday";
+#endif
+}
+
+static long bench_peak_rss_kb() {
+#if defined(HAVE_SYS_RESOURCE_H) && defined(HAVE_GETRUSAGE)
+    struct rusage usage;
+    if (0 != getrusage(RUSAGE_SELF, &usage)) {
+        return -1;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return -1;
+#endif
+}
+
+// count the data TLB loads of this process that missed and walked the page
+// tables, when the kernel and its perf_event_paranoid setting allow it
+static void bench_tlb_open() {
+#ifdef BENCH_PERF
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    bench_tlb_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+// start a workload: reset the TLB counter and return the time
+static uint64_t bench_start() {
+#ifdef BENCH_PERF
+    if (bench_tlb_fd >= 0) {
+        ioctl(bench_tlb_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(bench_tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    return bench_now_ns();
+}
+
+// return the TLB misses since bench_start, or -1
+static int64_t bench_tlb_misses() {
+#ifdef BENCH_PERF
+    uint64_t count;
+
+    if (bench_tlb_fd >= 0) {
+        ioctl(bench_tlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (sizeof(count) == read(bench_tlb_fd, &count, sizeof(count))) {
+            return (int64_t)count;
+        }
+    }
+#endif
+    return -1;
+}
+
+// smallest observable difference between two consecutive timer reads,
+// included in every latency sample below but in no throughput
+static uint64_t bench_timer_overhead() {
+    uint64_t best = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        uint64_t start = bench_now_ns();
+        uint64_t elapsed = bench_now_ns() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+// keys are derived from a bijective scramble of their index, so a run with
+// the same seed always produces the same key set in the same order
+static bool bench_keys_new(bench_keys *keys, size_t count, bool longKeys, char tag) {
+    size_t width = longKeys ? sizeof(BENCH_LONG_KEY_PREFIX) - 1 + 18 : 18;
+    size_t i;
+
+    keys->count = count;
+    keys->keys = malloc(count * sizeof(char *));
+    keys->blob = malloc(count * width);
+    if (NULL == keys->keys || NULL == keys->blob) {
+        free(keys->keys);
+        free(keys->blob);
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        uint64_t scrambled = (i + 1) * 0x9e3779b97f4a7c15ULL;
+        keys->keys[i] = keys->blob + i * width;
+        snprintf(keys->keys[i], width, "%s%c%016llx", longKeys ? BENCH_LONG_KEY_PREFIX : "",
+                 tag, (unsigned long long)(scrambled >> 4));
+    }
+
+    return true;
+}
+
+static void bench_keys_free(bench_keys *keys) {
+    free(keys->keys);
+    free(keys->blob);
+}
+
+static void bench_shuffle(size_t *order, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    for (i = count - 1; i > 0; i--) {
+        size_t j = bench_rand() % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+// Zipfian ranks by inversion of the precomputed distribution, rank 0 being
+// the hottest key; ranks are mapped to keys through a random permutation
+static bool bench_zipf(size_t *picks, size_t ops, size_t count) {
+    double *cdf = malloc(count * sizeof(double));
+    size_t *order = malloc(count * sizeof(size_t));
+    double sum = 0;
+    size_t i;
+
+    if (NULL == cdf || NULL == order) {
+        free(cdf);
+        free(order);
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        sum += 1.0 / pow((double)(i + 1), BENCH_ZIPF_THETA);
+        cdf[i] = sum;
+    }
+    bench_shuffle(order, count);
+
+    for (i = 0; i < ops; i++) {
+        double u = (double)(bench_rand() >> 11) / (double)(1ULL << 53) * sum;
+        size_t low = 0;
+        size_t high = count - 1;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (cdf[mid] < u) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        picks[i] = order[low];
+    }
+
+    free(cdf);
+    free(order);
+    return true;
+}
+
+static void bench_uniform(size_t *picks, size_t ops, size_t count) {
+    size_t i;
+
+    for (i = 0; i < ops; i++) {
+        picks[i] = bench_rand() % count;
+    }
+}
+
+static int bench_compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t bench_percentile(const uint32_t *sorted, size_t count, double p) {
+    size_t rank = (size_t)(p * (count - 1) + 0.5);
+    return sorted[rank];
+}
+
+// latencies holds one sample per operation, or per batch of operations,
+// taken apart from the untimed run that wall and tlbMisses come from
+static void bench_report(const char *workload, const char *dist, size_t keyLen, size_t count,
+                         uint32_t *latencies, size_t samples, size_t ops, uint64_t wall, int64_t tlbMisses) {
+    char tlb[32] = "null";
+
+    qsort(latencies, samples, sizeof(uint32_t), bench_compare_u32);
+    if (tlbMisses >= 0) {
+        snprintf(tlb, sizeof(tlb), "%.3f", (double)tlbMisses / ops);
+    }
+
+    printf("{\"workload\":\"%s\",\"dist\":\"%s\",\"key_len\":%zu,\"keys\":%zu,\"ops\":%zu,"
+           "\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%u,\"p90_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"max_ns\":%u,"
+           "\"dtlb_misses_per_op\":%s,\"peak_rss_kb\":%ld}\n",
+           workload, dist, keyLen, count, ops,
+           (double)wall / ops, ops * 1e9 / wall,
+           bench_percentile(latencies, samples, 0.50), bench_percentile(latencies, samples, 0.90),
+           bench_percentile(latencies, samples, 0.99), bench_percentile(latencies, samples, 0.999),
+           latencies[samples - 1], tlb, bench_peak_rss_kb());
+    fflush(stdout);
+}
+
+static void bench_count(const char *key, void *value, void *arg) {
+    __atomic_add_fetch((size_t *)arg, 1, __ATOMIC_RELAXED);
+}
+
+static bool bench_keep_half(const char *key, void *value, void *arg) {
+    return key[strlen(key) - 1] & 1;
+}
+
+// a latency past 4 s is kept as the largest sample instead of wrapping
+static uint32_t bench_latency(uint64_t ns) {
+    return ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+#define BENCH_TIMED(latencies, i, op) do {              \
+        uint64_t __start = bench_now_ns();              \
+        op;                                             \
+        (latencies)[i] = bench_latency(bench_now_ns() - __start); \
+    } while (0)
+
+// run op for i in [0, n) without reading the timer, for the throughput and
+// the TLB misses, then once more timing every op. op must leave the table
+// as it found it
+#define BENCH_MEASURE(latencies, i, n, wall, tlb, op) do {         \
+        uint64_t __start = bench_start();                          \
+        for (i = 0; i < (n); i++) {                                \
+            op;                                                    \
+        }                                                          \
+        (wall) = bench_now_ns() - __start;                         \
+        (tlb) = bench_tlb_misses();                                \
+        for (i = 0; i < (n); i++) {                                \
+            BENCH_TIMED(latencies, i, op);                         \
+        }                                                          \
+    } while (0)
+
+// return a table with the options of the run, or NULL
+static hashtable_ctx *bench_table_new(hashtable_allocator *allocator) {
+    if (bench_hugepage_size && NULL == allocator) {
+        return NULL;
+    }
+
+    hashtable_ctx *ht = hashtable_new_with_allocator(0, allocator);
+    if (NULL == ht) {
+        return NULL;
+    }
+    if ((bench_async_expand && !hashtable_async_expand(ht, true)) ||
+        (bench_bloom_filter && !hashtable_bloom_filter(ht, true))) {
+        hashtable_destroy(ht);
+        return NULL;
+    }
+
+    return ht;
+}
+
+static bool bench_run(size_t count, bool longKeys) {
+    bench_keys present;
+    bench_keys absent;
+    size_t ops = count > BENCH_MIN_OPS ? count : BENCH_MIN_OPS;
+    size_t *picks = malloc(ops * sizeof(size_t));
+    uint32_t *latencies = malloc(ops * sizeof(uint32_t));
+    void *volatile sink;
+    uint64_t start;
+    uint64_t wall;
+    int64_t tlb;
+    size_t i;
+    int dist;
+
+    if (NULL == picks || NULL == latencies) {
+        free(picks);
+        free(latencies);
+        return false;
+    }
+    if (!bench_keys_new(&present, count, longKeys, 'k')) {
+        free(picks);
+        free(latencies);
+        return false;
+    }
+    if (!bench_keys_new(&absent, count, longKeys, 'm')) {
+        bench_keys_free(&present);
+        free(picks);
+        free(latencies);
+        return false;
+    }
+    size_t keyLen = strlen(present.keys[0]);
+
+    hashtable_allocator *allocator = NULL;
+    if (bench_hugepage_size) {
+        allocator = hashtable_hugepage_new(bench_hugepage_size);
+    }
+
+    hashtable_ctx *ht = bench_table_new(allocator);
+    if (NULL == ht) {
+        if (allocator) {
+            hashtable_hugepage_destroy(allocator);
+        }
+        bench_keys_free(&present);
+        bench_keys_free(&absent);
+        free(picks);
+        free(latencies);
+        return false;
+    }
+
+    // insert into an empty table, paying for every expansion on the way.
+    // inserts and deletes cannot run twice on the same table, their
+    // latencies are taken on a second table once this one is gone
+    bench_shuffle(picks, count);
+    start = bench_start();
+    for (i = 0; i < count; i++) {
+        hashtable_set(ht, present.keys[picks[i]], present.keys[picks[i]]);
+    }
+    uint64_t insertWall = bench_now_ns() - start;
+    int64_t insertTlb = bench_tlb_misses();
+
+    if (allocator) {
+        hashtable_hugepage_statistics stats;
+        hashtable_hugepage_stats(allocator, &stats);
+        printf("{\"hugepage\":{\"key_len\":%zu,\"keys\":%zu,\"hugetlb_mappings\":%zu,"
+               "\"madvise_mappings\":%zu,\"mapped_bytes\":%zu,\"chunk_bytes\":%zu}}\n",
+               keyLen, count, stats.hugetlb_mappings, stats.madvise_mappings,
+               stats.mapped_bytes, stats.chunk_bytes);
+    }
+
+    hashtable_frozen *frozen = hashtable_freeze(ht);
+
+    for (dist = BENCH_UNIFORM; dist <= BENCH_ZIPF; dist++) {
+        const char *distName = BENCH_ZIPF == dist ? "zipf" : "uniform";
+
+        if (BENCH_ZIPF == dist) {
+            if (!bench_zipf(picks, ops, count)) {
+                break;
+            }
+        } else {
+            bench_uniform(picks, ops, count);
+        }
+
+        BENCH_MEASURE(latencies, i, ops, wall, tlb, sink = hashtable_get(ht, present.keys[picks[i]]));
+        bench_report("get_hit", distName, keyLen, count, latencies, ops, ops, wall, tlb);
+
+        BENCH_MEASURE(latencies, i, ops, wall, tlb, sink = hashtable_get(ht, absent.keys[picks[i]]));
+        bench_report("get_miss", distName, keyLen, count, latencies, ops, ops, wall, tlb);
+
+        // one latency sample per batch, spread over its keys
+        size_t batches = ops / BENCH_BATCH;
+        const char *batchKeys[BENCH_BATCH];
+        void *batchValues[BENCH_BATCH];
+        size_t j;
+        start = bench_start();
+        for (i = 0; i < batches; i++) {
+            for (j = 0; j < BENCH_BATCH; j++) {
+                batchKeys[j] = present.keys[picks[i * BENCH_BATCH + j]];
+            }
+            hashtable_get_batch(ht, batchKeys, BENCH_BATCH, batchValues);
+        }
+        wall = bench_now_ns() - start;
+        tlb = bench_tlb_misses();
+        for (i = 0; i < batches; i++) {
+            for (j = 0; j < BENCH_BATCH; j++) {
+                batchKeys[j] = present.keys[picks[i * BENCH_BATCH + j]];
+            }
+            BENCH_TIMED(latencies, i, hashtable_get_batch(ht, batchKeys, BENCH_BATCH, batchValues));
+            latencies[i] /= BENCH_BATCH;
+        }
+        sink = batchValues[0];
+        bench_report("get_batch_hit", distName, keyLen, count, latencies, batches, batches * BENCH_BATCH, wall, tlb);
+
+        if (frozen) {
+            BENCH_MEASURE(latencies, i, ops, wall, tlb, sink = hashtable_frozen_get(frozen, present.keys[picks[i]]));
+            bench_report("frozen_get_hit", distName, keyLen, count, latencies, ops, ops, wall, tlb);
+
+            BENCH_MEASURE(latencies, i, ops, wall, tlb, sink = hashtable_frozen_get(frozen, absent.keys[picks[i]]));
+            bench_report("frozen_get_miss", distName, keyLen, count, latencies, ops, ops, wall, tlb);
+        }
+
+        // delete and reinsert the same key, keeping the table at its size
+        BENCH_MEASURE(latencies, i, ops, wall, tlb,
+                      hashtable_delete(ht, present.keys[picks[i]]);
+                      hashtable_set(ht, present.keys[picks[i]], present.keys[picks[i]]));
+        bench_report("churn", distName, keyLen, count, latencies, ops, ops, wall, tlb);
+    }
+    (void)sink;
+    if (frozen) {
+        hashtable_frozen_destroy(frozen);
+    }
+
+    // whole table operations run once, their latency is spread over the keys
+    size_t visited = 0;
+    start = bench_start();
+    hashtable_parallel_foreach(ht, bench_count, &visited, bench_threads);
+    wall = bench_now_ns() - start;
+    latencies[0] = bench_latency(wall / count);
+    bench_report("foreach", "uniform", keyLen, count, latencies, 1, count, wall, bench_tlb_misses());
+
+    hashtable_ctx *copy = hashtable_new_with_allocator(0, allocator);
+    if (copy) {
+        start = bench_start();
+        hashtable_merge(copy, ht, NULL, NULL, bench_threads);
+        wall = bench_now_ns() - start;
+        latencies[0] = bench_latency(wall / count);
+        bench_report("merge", "uniform", keyLen, count, latencies, 1, count, wall, bench_tlb_misses());
+
+        start = bench_start();
+        hashtable_filter(copy, bench_keep_half, NULL, bench_threads);
+        wall = bench_now_ns() - start;
+        latencies[0] = bench_latency(wall / count);
+        bench_report("filter", "uniform", keyLen, count, latencies, 1, count, wall, bench_tlb_misses());
+        hashtable_destroy(copy);
+    }
+
+    bench_shuffle(picks, count);
+    start = bench_start();
+    for (i = 0; i < count; i++) {
+        hashtable_delete(ht, present.keys[picks[i]]);
+    }
+    uint64_t deleteWall = bench_now_ns() - start;
+    int64_t deleteTlb = bench_tlb_misses();
+    hashtable_destroy(ht);
+
+    ht = bench_table_new(allocator);
+    if (ht) {
+        bench_shuffle(picks, count);
+        for (i = 0; i < count; i++) {
+            BENCH_TIMED(latencies, i, hashtable_set(ht, present.keys[picks[i]], present.keys[picks[i]]));
+        }
+        bench_report("insert", "uniform", keyLen, count, latencies, count, count, insertWall, insertTlb);
+
+        bench_shuffle(picks, count);
+        for (i = 0; i < count; i++) {
+            BENCH_TIMED(latencies, i, hashtable_delete(ht, present.keys[picks[i]]));
+        }
+        bench_report("delete", "uniform", keyLen, count, latencies, count, count, deleteWall, deleteTlb);
+        hashtable_destroy(ht);
+    }
+
+    if (allocator) {
+        hashtable_hugepage_destroy(allocator);
+    }
+    bench_keys_free(&present);
+    bench_keys_free(&absent);
+    free(picks);
+    free(latencies);
+    return true;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n keys]... [-s seed] [-k short|long|both] [-a] [-b] [-H 2m|1g] [-t threads]\n"
+            "  -n keys  table size to run, may be repeated (default 512 16384 262144 4194304)\n"
+            "  -s seed  random seed (default 1)\n"
+            "  -k len   key lengths to run (default both)\n"
+            "  -a       expand tables on a background thread\n"
+            "  -b       enable the Bloom filter of the tables\n"
+            "  -H size  allocate the tables with the huge page allocator\n"
+            "  -t n     threads of the whole table operations (default every cpu)\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    size_t sizes[BENCH_MAX_SIZES] = {512, 16384, 262144, 4194304};
+    size_t sizeCount = 4;
+    bool customSizes = false;
+    bool shortKeys = true;
+    bool longKeys = true;
+    uint64_t seed = 1;
+    size_t i;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "n:s:k:abH:t:h"))) {
+        switch (opt) {
+        case 'n':
+            if (!customSizes) {
+                customSizes = true;
+                sizeCount = 0;
+            }
+            if (sizeCount == BENCH_MAX_SIZES || 0 == (sizes[sizeCount] = strtoull(optarg, NULL, 10))) {
+                usage(argv[0]);
+                return 1;
+            }
+            sizeCount++;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'a':
+            bench_async_expand = true;
+            break;
+        case 'b':
+            bench_bloom_filter = true;
+            break;
+        case 'H':
+            if (0 == strcmp(optarg, "2m")) {
+                bench_hugepage_size = HASHTABLE_HUGEPAGE_2MB;
+            } else if (0 == strcmp(optarg, "1g")) {
+                bench_hugepage_size = HASHTABLE_HUGEPAGE_1GB;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            bench_threads = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            shortKeys = 0 != strcmp(optarg, "long");
+            longKeys = 0 != strcmp(optarg, "short");
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // xorshift must not start from zero
+    bench_rng_state = seed ? seed : 1;
+    bench_tlb_open();
+
+    printf("{\"bench\":\"%s\",\"version\":\"%s\",\"timer\":\"%s\",\"timer_overhead_ns\":%llu,\"seed\":%llu,\"async_expand\":%s,\"bloom_filter\":%s,"
+           "\"hugepage_size\":%zu,\"dtlb_counter\":%s,\"threads\":%zu}\n",
+           PACKAGE_NAME, PACKAGE_VERSION, bench_timer_name(),
+           (unsigned long long)bench_timer_overhead(), (unsigned long long)seed,
+           bench_async_expand ? "true" : "false", bench_bloom_filter ? "true" : "false",
+           bench_hugepage_size, bench_tlb_fd >= 0 ? "true" : "false", bench_threads);
+
+    for (i = 0; i < sizeCount; i++) {
+        if (shortKeys && !bench_run(sizes[i], false)) {
+            fprintf(stderr, "out of memory at %zu keys\n", sizes[i]);
+            return 1;
+        }
+        if (longKeys && !bench_run(sizes[i], true)) {
+            fprintf(stderr, "out of memory at %zu keys\n", sizes[i]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -1,10 +1,52 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <string.h>
-#include "hashtable.h"
+#include <unistd.h>
+#include <pthread.h>
+#include "hashtable_private.h"
 #include "murmur2.c"
 
+#ifdef HASHTABLE_STATS
+#if defined(HAVE_CLOCK_GETTIME) || defined(HAVE_GETHRTIME)
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+#endif
+
 #define HASHTABLE_EXPAND_THROTTLE 70
 
+// filter bits per key the table holds at HASHTABLE_EXPAND_THROTTLE, ~1% false positives
+#define HASHTABLE_BLOOM_BITS_PER_KEY 10
+// 32 bit words per filter block, one bit of every word is set per key
+#define HASHTABLE_BLOOM_WORDS 8
+
+// keys hashed and prefetched together by hashtable_get_batch
+#define HASHTABLE_BATCH 16
+
+// fewest buckets worth a thread of their own in the parallel bulk operations
+#define HASHTABLE_PARALLEL_MIN_BUCKETS 4096
+
+// log entries of an async expansion every write replays once the new
+// bucket array is in place, and empty log buckets skipped per entry
+#define HASHTABLE_REPLAY_ENTRIES 8
+#define HASHTABLE_REPLAY_SCAN 8
+
+#ifdef __GNUC__
+#define HASHTABLE_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define HASHTABLE_PREFETCH(addr) ((void)0)
+#endif
+
+#ifdef HASHTABLE_STATS
+#define HASHTABLE_STATS_ADD(ctx, field, n) ((ctx)->stats->field += (n))
+#else
+#define HASHTABLE_STATS_ADD(ctx, field, n) ((void)0)
+#endif
+
 // https://gcc.gnu.org/onlinedocs/gcc-4.7.1/libstdc%2B%2B/api/a01194_source.html
 const static size_t prime_numbers[] = {
     5,
@@ -52,208 +94,1941 @@ static size_t get_next_prime(size_t size) {
     return prime_numbers[i - 1];
 }
 
-static size_t hashtable_hash(hashtable_ctx *ctx, const char *key) {
-    return MurmurHash2(key, strlen(key)) % ctx->size;
+static uint32_t hashtable_key_hash(const char *key) {
+    return MurmurHash2(key, strlen(key));
+}
+
+static size_t hashtable_index(const char *key, size_t size) {
+    return hashtable_key_hash(key) % size;
+}
+
+static void *hashtable_default_malloc(void *ctx, size_t size) {
+    return malloc(size);
+}
+
+static void *hashtable_default_calloc(void *ctx, size_t size) {
+    return calloc(1, size);
+}
+
+static void *hashtable_default_realloc(void *ctx, void *ptr, size_t oldSize, size_t size) {
+    return realloc(ptr, size);
+}
+
+static void hashtable_default_free(void *ctx, void *ptr, size_t size) {
+    free(ptr);
+}
+
+static const hashtable_allocator hashtable_default_allocator = {
+    hashtable_default_malloc,
+    hashtable_default_calloc,
+    hashtable_default_realloc,
+    hashtable_default_free,
+    NULL
+};
+
+#ifdef HASHTABLE_STATS
+static uint64_t hashtable_now_ns() {
+#if defined(HAVE_CLOCK_GETTIME)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#elif defined(HAVE_GETHRTIME)
+    return gethrtime();
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+static void hashtable_stats_probe(hashtable_ctx *ctx, uint64_t probes, bool hit) {
+    hashtable_statistics *stats = ctx->stats;
+
+    stats->gets++;
+    if (hit) {
+        stats->hits++;
+    } else {
+        stats->misses++;
+    }
+    stats->probes += probes;
+    if (probes > stats->max_probes) {
+        stats->max_probes = probes;
+    }
+}
+#endif
+
+// the tables forked from one another
+struct __hashtable_family {
+    // tables not destroyed yet
+    size_t tables;
+    // pages and entries of all of them, with --enable-stats only
+    uint64_t bytes;
+};
+
+#ifdef HASHTABLE_STATS
+// count the bytes of pages and entries allocated, or freed when negative.
+// any table of a family may free what another one allocated, so a table
+// once forked counts them for the whole family
+static void hashtable_stats_memory(hashtable_ctx *ctx, int64_t bytes) {
+    if (ctx->family) {
+        __atomic_add_fetch(&ctx->family->bytes, (uint64_t)bytes, __ATOMIC_RELAXED);
+    } else {
+        ctx->stats->bytes_allocated += bytes;
+    }
 }
+#define HASHTABLE_STATS_MEMORY(ctx, n) hashtable_stats_memory(ctx, n)
+#else
+#define HASHTABLE_STATS_MEMORY(ctx, n) ((void)0)
+#endif
 
-static hashtable_entry *hashtable_new_entry(const char *key, uint32_t keyLen, void *value) {
-    hashtable_entry *entry = (hashtable_entry *)malloc(sizeof(hashtable_entry) + keyLen);
+static hashtable_entry *hashtable_new_entry(hashtable_ctx *ctx, const char *key, uint32_t keyLen, void *value) {
+    hashtable_entry *entry = ctx->allocator.malloc(ctx->allocator.ctx, sizeof(hashtable_entry) + keyLen);
     if (NULL == entry) {
         return NULL;
     }
+    HASHTABLE_STATS_MEMORY(ctx, sizeof(hashtable_entry) + keyLen);
 
     memcpy(entry->key, key, keyLen);
     entry->value = value;
     entry->next = NULL;
+    entry->refs = 1;
     return entry;
 }
 
-static bool hashtable_need_expand(hashtable_ctx *ctx) {
-    // cannot expand anymore
-    if (ctx->size >= prime_numbers[prime_number_count - 1]) {
-        return false;
+static void hashtable_free_entry(hashtable_ctx *ctx, hashtable_entry *entry) {
+    size_t size = sizeof(hashtable_entry) + strlen(entry->key) + 1;
+
+    HASHTABLE_STATS_MEMORY(ctx, -(int64_t)size);
+    ctx->allocator.free(ctx->allocator.ctx, entry, size);
+}
+
+// Entries, bucket arrays and the pages of overlays are shared between
+// forks. An entry counts the bucket slots and next pointers that reach it,
+// a shared bucket array is counted by ctx->table_refs, an overlay by the
+// tables and a page by the overlays holding it. Anything reachable through
+// a count above one is immutable and copied before it is modified.
+
+static bool hashtable_entry_shared(hashtable_entry *entry) {
+    return __atomic_load_n(&entry->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+static void hashtable_retain_entry(hashtable_entry *entry) {
+    if (entry) {
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
     }
+}
 
-    // used / size > 70%
-    if ((ctx->used * 100 / ctx->size) > HASHTABLE_EXPAND_THROTTLE) {
-        return true;
+// drop one reference to a chain, freeing the entries no table reaches anymore
+static void hashtable_release_chain(hashtable_ctx *ctx, hashtable_entry *entry) {
+    hashtable_entry *next;
+
+    while (entry && 0 == __atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL)) {
+        next = entry->next;
+        hashtable_free_entry(ctx, entry);
+        entry = next;
     }
+}
 
-    return false;
+static bool hashtable_node_shared(size_t *refs) {
+    return __atomic_load_n(refs, __ATOMIC_ACQUIRE) > 1;
 }
 
-hashtable_ctx *hashtable_new(size_t size) {
-    hashtable_ctx *ctx = calloc(1, sizeof(hashtable_ctx));
-    if (NULL == ctx) {
-        return NULL;
+static void hashtable_retain_node(size_t *refs) {
+    __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED);
+}
+
+static size_t hashtable_page_count(size_t size) {
+    return (size + HASHTABLE_PAGE_BUCKETS - 1) >> HASHTABLE_PAGE_BITS;
+}
+
+// buckets in the page numbered page of a table of size buckets
+static size_t hashtable_page_length(size_t size, size_t page) {
+    size_t rest = size - (page << HASHTABLE_PAGE_BITS);
+    return rest < HASHTABLE_PAGE_BUCKETS ? rest : HASHTABLE_PAGE_BUCKETS;
+}
+
+static size_t hashtable_overlay_bytes(size_t size) {
+    return sizeof(hashtable_overlay) + hashtable_page_count(size) * sizeof(hashtable_page *);
+}
+
+static void *hashtable_node_new(hashtable_ctx *ctx, size_t size, bool zero) {
+    void *node;
+
+    // a zeroing allocator can hand out fresh pages without writing them
+    if (zero && ctx->allocator.calloc) {
+        node = ctx->allocator.calloc(ctx->allocator.ctx, size);
+    } else {
+        node = ctx->allocator.malloc(ctx->allocator.ctx, size);
+        if (node && zero) {
+            memset(node, 0, size);
+        }
+    }
+    if (node) {
+        HASHTABLE_STATS_MEMORY(ctx, size);
     }
 
-    size = get_next_prime(size);
-    ctx->size = size;
-    ctx->used = 0;
+    return node;
+}
 
-    ctx->table = calloc(ctx->size, sizeof(hashtable_entry *));
-    if (NULL == ctx->table) {
-        free(ctx);
-        return NULL;
+static void hashtable_node_free(hashtable_ctx *ctx, void *node, size_t size) {
+    HASHTABLE_STATS_MEMORY(ctx, -(int64_t)size);
+    ctx->allocator.free(ctx->allocator.ctx, node, size);
+}
+
+// drop a reference to the page numbered index of a table of size buckets,
+// and to its chains once no overlay holds it
+static void hashtable_release_page(hashtable_ctx *ctx, hashtable_page *page, size_t size, size_t index) {
+    size_t length = hashtable_page_length(size, index);
+    size_t i;
+
+    if (NULL == page || 0 != __atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
     }
 
-    return ctx;
+    for (i = 0; i < length; i++) {
+        hashtable_release_chain(ctx, page->buckets[i]);
+    }
+    hashtable_node_free(ctx, page, sizeof(hashtable_page));
 }
 
-void hashtable_destroy(hashtable_ctx *ctx) {
+// drop a reference to the overlay of a table of size buckets
+static void hashtable_release_overlay(hashtable_ctx *ctx, hashtable_overlay *overlay, size_t size) {
+    size_t count = hashtable_page_count(size);
     size_t i;
-    hashtable_entry *current;
-    hashtable_entry *next;
 
-    for (i = 0; i < ctx->size; i++) {
-        current = ctx->table[i];
-        while (current) {
-            next = current->next;
-            free(current);
-            current = next;
+    if (0 != __atomic_sub_fetch(&overlay->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        hashtable_release_page(ctx, overlay->pages[i], size, i);
+    }
+    hashtable_node_free(ctx, overlay, hashtable_overlay_bytes(size));
+}
+
+// drop a reference to a bucket array and the chains it holds
+static void hashtable_release_table(hashtable_ctx *ctx, hashtable_entry **table, size_t size, size_t *refs) {
+    size_t i;
+
+    if (refs) {
+        if (0 != __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL)) {
+            return;
         }
+        free(refs);
     }
-    free(ctx->table);
-    free(ctx);
+
+    for (i = 0; i < size; i++) {
+        hashtable_release_chain(ctx, table[i]);
+    }
+    hashtable_node_free(ctx, table, size * sizeof(hashtable_entry *));
 }
 
-bool hashtable_set(hashtable_ctx *ctx, const char *key, void *value) {
-    uint32_t index = hashtable_hash(ctx, key);
+// drop the buckets of ctx, its overlay included
+static void hashtable_release_buckets(hashtable_ctx *ctx) {
+    if (ctx->overlay) {
+        hashtable_release_overlay(ctx, ctx->overlay, ctx->size);
+    }
+    hashtable_release_table(ctx, ctx->table, ctx->size, ctx->table_refs);
+}
 
-    hashtable_entry *current = ctx->table[index];
+// fold the overlay back into the bucket array once no other table shares
+// either of them, so that the table is flat again
+static void hashtable_flatten(hashtable_ctx *ctx) {
+    hashtable_overlay *overlay = ctx->overlay;
+    size_t count = hashtable_page_count(ctx->size);
+    hashtable_entry **slice;
+    hashtable_page *page;
+    size_t length;
+    size_t i;
+    size_t j;
 
-    while (current) {
-        if (0 == strcmp(current->key, key)) {
-            current->value = value;
-            return true;
+    free(ctx->table_refs);
+    ctx->table_refs = NULL;
+    ctx->overlay = NULL;
+    if (NULL == overlay) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        page = overlay->pages[i];
+        if (NULL == page) {
+            continue;
         }
-        current = current->next;
+        length = hashtable_page_length(ctx->size, i);
+        slice = ctx->table + (i << HASHTABLE_PAGE_BITS);
+        for (j = 0; j < length; j++) {
+            hashtable_release_chain(ctx, slice[j]);
+        }
+        // the references the page holds move to the array
+        memcpy(slice, page->buckets, length * sizeof(hashtable_entry *));
+        hashtable_node_free(ctx, page, sizeof(hashtable_page));
     }
+    hashtable_node_free(ctx, overlay, hashtable_overlay_bytes(ctx->size));
+}
 
-    hashtable_entry *newItem = hashtable_new_entry(key, strlen(key) + 1, value);
-    if (NULL == newItem) {
-        return false;
+// give ctx its own overlay, still sharing the pages
+static bool hashtable_unshare_overlay(hashtable_ctx *ctx) {
+    hashtable_overlay *old = ctx->overlay;
+    size_t count = hashtable_page_count(ctx->size);
+    size_t i;
+
+    if (old && !hashtable_node_shared(&old->refs)) {
+        return true;
     }
 
-    ctx->used++;
-    newItem->next = ctx->table[index];
-    ctx->table[index] = newItem;
+    hashtable_overlay *overlay = hashtable_node_new(ctx, hashtable_overlay_bytes(ctx->size), NULL == old);
+    if (NULL == overlay) {
+        return false;
+    }
+    overlay->refs = 1;
+    ctx->overlay = overlay;
 
-    if (hashtable_need_expand(ctx)) {
-        hashtable_expand(ctx, get_next_prime(ctx->size + 1));
+    if (old) {
+        for (i = 0; i < count; i++) {
+            overlay->pages[i] = old->pages[i];
+            if (overlay->pages[i]) {
+                hashtable_retain_node(&overlay->pages[i]->refs);
+            }
+        }
+        // the other tables may have let go of it meanwhile
+        hashtable_release_overlay(ctx, old, ctx->size);
     }
 
     return true;
 }
 
-void *hashtable_get(hashtable_ctx *ctx, const char *key) {
-    uint32_t index = hashtable_hash(ctx, key);
+// give the overlay of ctx, which must be its own, its own copy of the page
+// numbered index, still sharing the chains. return the page, NULL if out of memory
+static hashtable_page *hashtable_unshare_page(hashtable_ctx *ctx, size_t index) {
+    hashtable_page **slot = &ctx->overlay->pages[index];
+    hashtable_page *old = *slot;
+    size_t length = hashtable_page_length(ctx->size, index);
+    size_t i;
 
-    hashtable_entry *current = ctx->table[index];
+    if (old && !hashtable_node_shared(&old->refs)) {
+        return old;
+    }
 
-    while (current) {
-        if (0 == strcmp(current->key, key)) {
-            return current->value;
-        }
-        current = current->next;
+    hashtable_page *page = hashtable_node_new(ctx, sizeof(hashtable_page), false);
+    if (NULL == page) {
+        return NULL;
+    }
+    page->refs = 1;
+    memcpy(page->buckets, old ? old->buckets : ctx->table + (index << HASHTABLE_PAGE_BITS),
+           length * sizeof(hashtable_entry *));
+    for (i = 0; i < length; i++) {
+        hashtable_retain_entry(page->buckets[i]);
+    }
+    *slot = page;
+    if (old) {
+        hashtable_release_page(ctx, old, ctx->size, index);
     }
 
-    return NULL;
+    return page;
 }
 
-bool hashtable_delete(hashtable_ctx *ctx, const char *key) {
-    uint32_t index = hashtable_hash(ctx, key);
+// let ctx write to its buckets: a table left alone with its bucket array
+// flattens it, one still sharing it gets its own overlay. done before the
+// parallel workers start, so that they only ever copy pages
+static bool hashtable_unshare_buckets(hashtable_ctx *ctx) {
+    if (NULL == ctx->table_refs) {
+        return true;
+    }
+
+    if (!hashtable_node_shared(ctx->table_refs)) {
+        hashtable_flatten(ctx);
+        return true;
+    }
 
-    hashtable_entry *current = ctx->table[index];
-    hashtable_entry *prev;
+    return hashtable_unshare_overlay(ctx);
+}
+
+// whether the way to the bucket at index is shared, and so is its chain
+static bool hashtable_bucket_shared(hashtable_ctx *ctx, size_t index) {
+    hashtable_page *page;
 
-    if (NULL == current) {
+    if (NULL == ctx->table_refs) {
         return false;
-    } else if (0 == strcmp(current->key, key)) {
-        ctx->table[index] = current->next;
-        free(current);
-        ctx->used--;
-        return true;
-    } else {
-        prev = current;
-        current = prev->next;
+    }
 
-        while (current) {
-            if (0 == strcmp(current->key, key)) {
-                prev->next = current->next;
-                free(current);
-                ctx->used--;
-                return true;
-            }
-            prev = current;
-            current = current->next;
-        }
+    if (ctx->overlay && (page = ctx->overlay->pages[index >> HASHTABLE_PAGE_BITS])) {
+        return hashtable_node_shared(&ctx->overlay->refs) || hashtable_node_shared(&page->refs);
     }
 
-    return false;
+    return hashtable_node_shared(ctx->table_refs);
 }
 
-bool hashtable_expand(hashtable_ctx *ctx, size_t size) {
-    size = get_next_prime(size);
+// the bucket at index of a table hashtable_unshare_buckets was called on,
+// once ctx has its own copy of it. NULL if out of memory
+static hashtable_entry **hashtable_page_write(hashtable_ctx *ctx, size_t index) {
+    hashtable_page *page;
 
-    if (ctx->size == size) {
-        return false;
+    if (NULL == ctx->table_refs) {
+        return &ctx->table[index];
     }
 
-    if ((ctx->used * 100 / size) > HASHTABLE_EXPAND_THROTTLE) {
-        return false;
+    page = hashtable_unshare_page(ctx, index >> HASHTABLE_PAGE_BITS);
+    return page ? &page->buckets[index & (HASHTABLE_PAGE_BUCKETS - 1)] : NULL;
+}
+
+// the bucket at index, once ctx has its own copy of it. NULL if out of memory
+static hashtable_entry **hashtable_bucket_write(hashtable_ctx *ctx, size_t index) {
+    if (NULL == ctx->table_refs) {
+        return &ctx->table[index];
     }
 
-    hashtable_ctx *tmpCtx = hashtable_new(size);
-    if (NULL == tmpCtx) {
-        return false;
+    if (false == hashtable_unshare_buckets(ctx)) {
+        return NULL;
     }
 
+    return hashtable_page_write(ctx, index);
+}
+
+// copy the shared entries of the chain at link, a bucket ctx has its own
+// copy of, up to the entry matching key, which must be in it, or all of them
+// when key is NULL. return the link pointing to that entry, NULL if out of memory
+static hashtable_entry **hashtable_unshare_chain(hashtable_ctx *ctx, hashtable_entry **link, const char *key) {
     hashtable_entry *current;
-    hashtable_entry *next;
-    size_t i;
+    hashtable_entry *copy;
 
-    for (i = 0; i < ctx->size; i++) {
-        current = ctx->table[i];
-        while (current) {
-            next = current->next;
-            if (false == hashtable_set(tmpCtx, current->key, current->value)) {
-                hashtable_destroy(tmpCtx);
-                return false;
+    if (NULL == link) {
+        return NULL;
+    }
+
+    while ((current = *link)) {
+        if (hashtable_entry_shared(current)) {
+            copy = hashtable_new_entry(ctx, current->key, strlen(current->key) + 1, current->value);
+            if (NULL == copy) {
+                return NULL;
             }
-            current = next;
+            copy->next = current->next;
+            hashtable_retain_entry(copy->next);
+            *link = copy;
+            hashtable_release_chain(ctx, current);
+            current = copy;
+        }
+        if (key && 0 == strcmp(current->key, key)) {
+            break;
         }
+        link = &current->next;
     }
 
-    for (i = 0; i < ctx->size; i++) {
-        current = ctx->table[i];
-        while (current) {
-            next = current->next;
-            free(current);
-            current = next;
+    return link;
+}
+
+// give ctx its own flat bucket array and entries, so that they can be
+// relinked. a table forked from or to another one copies what it shares
+static bool hashtable_unshare_all(hashtable_ctx *ctx) {
+    hashtable_entry **table;
+    size_t i;
+
+    if (NULL == ctx->family) {
+        return true;
+    }
+
+    if (ctx->table_refs && !hashtable_node_shared(ctx->table_refs)) {
+        hashtable_flatten(ctx);
+    }
+
+    if (ctx->table_refs) {
+        table = hashtable_node_new(ctx, ctx->size * sizeof(hashtable_entry *), false);
+        if (NULL == table) {
+            return false;
+        }
+        for (i = 0; i < ctx->size; i++) {
+            table[i] = *hashtable_bucket(ctx, i);
+            hashtable_retain_entry(table[i]);
         }
+        hashtable_release_buckets(ctx);
+        ctx->table = table;
+        ctx->table_refs = NULL;
+        ctx->overlay = NULL;
     }
-    free(ctx->table);
 
-    ctx->size = size;
-    ctx->table = tmpCtx->table;
-    free(tmpCtx);
+    for (i = 0; i < ctx->size; i++) {
+        if (NULL == hashtable_unshare_chain(ctx, &ctx->table[i], NULL)) {
+            return false;
+        }
+    }
 
     return true;
 }
 
-bool hashtable_resize(hashtable_ctx *ctx) {
-    // should not overflow
-    if ((ctx->used < 1) < ctx->used) {
+static bool hashtable_need_expand(hashtable_ctx *ctx) {
+    // cannot expand anymore
+    if (ctx->size >= prime_numbers[prime_number_count - 1]) {
         return false;
     }
 
-    // ensure used/size < 50%
-    size_t size = get_next_prime(ctx->used < 1);
-    if (size >= ctx->size) {
-        return false;
+    // used / size > 70%
+    if ((ctx->used * 100 / ctx->size) > HASHTABLE_EXPAND_THROTTLE) {
+        return true;
     }
 
-    return hashtable_expand(ctx, size);
+    return false;
+}
+
+// Split block Bloom filter: every key sets one bit in each word of a single
+// block, so a lookup touches one cache line. The filter is keyed off the
+// MurmurHash2 value the table computes anyway. Deleted keys are left in the
+// filter until it is rebuilt, which happens on every expansion and once
+// enough deletes went stale. A fork shares the blocks until either side
+// rebuilds them, both adding their keys, which only costs false positives.
+
+struct __hashtable_bloom {
+    uint32_t (*blocks)[HASHTABLE_BLOOM_WORDS];
+    // set while blocks is shared with a fork
+    size_t *refs;
+    size_t count;
+    size_t capacity;
+    // keys deleted since the filter was built
+    size_t stale;
+
+    // maintained by gets, with --enable-stats only
+    uint64_t lookups;
+    uint64_t negatives;
+    uint64_t falsePositives;
+};
+
+// https://github.com/apache/parquet-format/blob/master/BloomFilter.md
+const static uint32_t hashtable_bloom_salts[HASHTABLE_BLOOM_WORDS] = {
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31
+};
+
+// a filter for a table of size buckets
+static hashtable_bloom *hashtable_bloom_new(size_t size) {
+    hashtable_bloom *bloom = calloc(1, sizeof(hashtable_bloom));
+    if (NULL == bloom) {
+        return NULL;
+    }
+
+    bloom->capacity = size * HASHTABLE_EXPAND_THROTTLE / 100 + 1;
+    bloom->count = (bloom->capacity * HASHTABLE_BLOOM_BITS_PER_KEY + HASHTABLE_BLOOM_WORDS * 32 - 1) /
+        (HASHTABLE_BLOOM_WORDS * 32);
+    if (0 != posix_memalign((void **)&bloom->blocks, 64, bloom->count * sizeof(*bloom->blocks))) {
+        free(bloom);
+        return NULL;
+    }
+    memset(bloom->blocks, 0, bloom->count * sizeof(*bloom->blocks));
+
+    return bloom;
+}
+
+// a filter for a fork, sharing the blocks of bloom. NULL if out of memory
+static hashtable_bloom *hashtable_bloom_share(hashtable_bloom *bloom) {
+    hashtable_bloom *copy = calloc(1, sizeof(hashtable_bloom));
+    if (NULL == copy) {
+        return NULL;
+    }
+
+    if (NULL == bloom->refs) {
+        bloom->refs = malloc(sizeof(size_t));
+        if (NULL == bloom->refs) {
+            free(copy);
+            return NULL;
+        }
+        *bloom->refs = 1;
+    }
+    __atomic_add_fetch(bloom->refs, 1, __ATOMIC_RELAXED);
+
+    copy->blocks = bloom->blocks;
+    copy->refs = bloom->refs;
+    copy->capacity = bloom->capacity;
+    copy->count = bloom->count;
+    copy->stale = bloom->stale;
+
+    return copy;
+}
+
+static void hashtable_bloom_free(hashtable_bloom *bloom) {
+    if (NULL == bloom->refs || 0 == __atomic_sub_fetch(bloom->refs, 1, __ATOMIC_ACQ_REL)) {
+        free(bloom->refs);
+        free(bloom->blocks);
+    }
+    free(bloom);
+}
+
+static uint32_t *hashtable_bloom_block(hashtable_bloom *bloom, uint32_t hash) {
+    // the bucket index uses hash modulo a prime, pick the block from differently mixed bits
+    uint32_t mixed = ((uint64_t)hash * 0x9e3779b97f4a7c15ULL) >> 32;
+    return bloom->blocks[((uint64_t)mixed * bloom->count) >> 32];
+}
+
+// for threads adding keys to the same filter at once
+static void hashtable_bloom_add_atomic(hashtable_bloom *bloom, uint32_t hash) {
+    uint32_t *block = hashtable_bloom_block(bloom, hash);
+    int i;
+
+    for (i = 0; i < HASHTABLE_BLOOM_WORDS; i++) {
+        __atomic_fetch_or(&block[i], (uint32_t)1 << ((hash * hashtable_bloom_salts[i]) >> 27), __ATOMIC_RELAXED);
+    }
+}
+
+static void hashtable_bloom_add(hashtable_bloom *bloom, uint32_t hash) {
+    uint32_t *block = hashtable_bloom_block(bloom, hash);
+    int i;
+
+    // the forks sharing the blocks may be adding to them
+    if (bloom->refs) {
+        hashtable_bloom_add_atomic(bloom, hash);
+        return;
+    }
+
+    for (i = 0; i < HASHTABLE_BLOOM_WORDS; i++) {
+        block[i] |= (uint32_t)1 << ((hash * hashtable_bloom_salts[i]) >> 27);
+    }
+}
+
+static bool hashtable_bloom_contains(hashtable_bloom *bloom, uint32_t hash) {
+    uint32_t *block = hashtable_bloom_block(bloom, hash);
+    uint32_t missing = 0;
+    int i;
+
+    if (bloom->refs) {
+        for (i = 0; i < HASHTABLE_BLOOM_WORDS; i++) {
+            missing |= ~__atomic_load_n(&block[i], __ATOMIC_RELAXED) &
+                ((uint32_t)1 << ((hash * hashtable_bloom_salts[i]) >> 27));
+        }
+        return 0 == missing;
+    }
+
+    for (i = 0; i < HASHTABLE_BLOOM_WORDS; i++) {
+        missing |= ~block[i] & ((uint32_t)1 << ((hash * hashtable_bloom_salts[i]) >> 27));
+    }
+
+    return 0 == missing;
+}
+
+// replace the filter by one sized for the current table, keeping the counters
+static bool hashtable_bloom_rebuild(hashtable_ctx *ctx) {
+    hashtable_bloom *bloom = hashtable_bloom_new(ctx->size);
+    hashtable_entry *current;
+    size_t i;
+
+    if (NULL == bloom) {
+        return false;
+    }
+
+    for (i = 0; i < ctx->size; i++) {
+        for (current = *hashtable_bucket(ctx, i); current; current = current->next) {
+            hashtable_bloom_add(bloom, hashtable_key_hash(current->key));
+        }
+    }
+
+    if (ctx->bloom) {
+        bloom->lookups = ctx->bloom->lookups;
+        bloom->negatives = ctx->bloom->negatives;
+        bloom->falsePositives = ctx->bloom->falsePositives;
+        hashtable_bloom_free(ctx->bloom);
+    }
+    ctx->bloom = bloom;
+
+    return true;
+}
+
+// swap in a filter built alongside a new bucket array, return the old one
+static hashtable_bloom *hashtable_bloom_replace(hashtable_ctx *ctx, hashtable_bloom *bloom) {
+    hashtable_bloom *old = ctx->bloom;
+
+    bloom->lookups = old->lookups;
+    bloom->negatives = old->negatives;
+    bloom->falsePositives = old->falsePositives;
+    ctx->bloom = bloom;
+
+    return old;
+}
+
+// Asynchronous expansion: the worker copies the entries of the current
+// bucket array, which is frozen while it runs, into a larger one. The
+// foreground keeps reading the frozen array and records its writes in a
+// log table, deletes as tombstones. The first write after the worker is
+// done swaps in the new array and hands the old array and filter to
+// another thread to free. Every write after that replays a few entries of
+// the log onto the new array, so that no single operation pays for all of
+// it, and goes to the array itself, dropping its key from the log. The log
+// only shrinks from then on, and gets look there first until it is empty.
+
+struct __hashtable_async {
+    bool running;
+    bool done;
+    pthread_t thread;
+
+    // frozen input
+    hashtable_allocator allocator;
+    hashtable_entry **table;
+    hashtable_overlay *overlay;
+    size_t size;
+
+    // output, owned by the worker until done
+    hashtable_entry **newTable;
+    size_t newSize;
+    hashtable_bloom *newBloom;
+    hashtable_statistics stats;
+    uint64_t ns;
+
+    // writes made since the worker started and not replayed yet, and the
+    // bucket of the log replayed next
+    hashtable_ctx *log;
+    size_t replayed;
+
+    // the buckets, filter and log left over by the last expansion, in a
+    // private context owned by the freeing thread until freed
+    bool freeing;
+    bool freed;
+    pthread_t freeThread;
+    hashtable_ctx old;
+    hashtable_statistics oldStats;
+    hashtable_ctx *oldLog;
+};
+
+static char hashtable_tombstone;
+
+static bool hashtable_put(hashtable_ctx *ctx, const char *key, void *value);
+static bool hashtable_remove(hashtable_ctx *ctx, const char *key);
+
+static hashtable_entry *hashtable_find(const hashtable_ctx *ctx, const char *key) {
+    hashtable_entry *current = *hashtable_bucket(ctx, hashtable_index(key, ctx->size));
+
+    while (current) {
+        if (0 == strcmp(current->key, key)) {
+            return current;
+        }
+        current = current->next;
+    }
+
+    return NULL;
+}
+
+static void *hashtable_async_run(void *arg) {
+    hashtable_async *async = arg;
+    // a private context, so that the worker never touches the statistics of the table
+    hashtable_ctx worker = {.size = async->newSize, .allocator = async->allocator, .stats = &async->stats};
+    hashtable_ctx frozen = {.size = async->size, .table = async->table, .overlay = async->overlay};
+    hashtable_entry *current;
+    hashtable_entry *copy;
+    hashtable_entry **bucket;
+    hashtable_bloom *bloom = NULL;
+    size_t i;
+    uint32_t hash;
+
+#ifdef HASHTABLE_STATS
+    uint64_t start = hashtable_now_ns();
+#endif
+
+    worker.table = hashtable_node_new(&worker, async->newSize * sizeof(hashtable_entry *), true);
+    if (NULL == worker.table) {
+        __atomic_store_n(&async->done, true, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    // without a new filter the old one stays in place, it is merely smaller
+    if (async->newBloom) {
+        bloom = hashtable_bloom_new(async->newSize);
+    }
+
+    for (i = 0; i < async->size; i++) {
+        for (current = *hashtable_bucket(&frozen, i); current; current = current->next) {
+            copy = hashtable_new_entry(&worker, current->key, strlen(current->key) + 1, current->value);
+            if (NULL == copy) {
+                hashtable_release_table(&worker, worker.table, async->newSize, NULL);
+                if (bloom) {
+                    hashtable_bloom_free(bloom);
+                }
+                async->newBloom = NULL;
+                __atomic_store_n(&async->done, true, __ATOMIC_RELEASE);
+                return NULL;
+            }
+            hash = hashtable_key_hash(copy->key);
+            bucket = &worker.table[hash % async->newSize];
+            copy->next = *bucket;
+            *bucket = copy;
+            if (bloom) {
+                hashtable_bloom_add(bloom, hash);
+            }
+        }
+    }
+
+    async->newTable = worker.table;
+    async->newBloom = bloom;
+#ifdef HASHTABLE_STATS
+    async->ns = hashtable_now_ns() - start;
+#endif
+    __atomic_store_n(&async->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static bool hashtable_async_start(hashtable_ctx *ctx, size_t size) {
+    hashtable_async *async = ctx->async;
+
+    // as many buckets as the worker copies entries, so that the log seldom
+    // has to grow, which it does on the serving thread. untouched buckets
+    // of a zeroing allocator cost no memory
+    async->log = hashtable_new_with_allocator(ctx->used, &ctx->allocator);
+    if (NULL == async->log) {
+        return false;
+    }
+
+    async->allocator = ctx->allocator;
+    async->table = ctx->table;
+    async->overlay = ctx->overlay;
+    async->size = ctx->size;
+    async->replayed = 0;
+    async->newTable = NULL;
+    async->newSize = size;
+    // tells the worker to build a filter
+    async->newBloom = ctx->bloom;
+    memset(&async->stats, 0, sizeof(async->stats));
+    async->ns = 0;
+    async->done = false;
+
+    if (0 != pthread_create(&async->thread, NULL, hashtable_async_run, async)) {
+        hashtable_destroy(async->log);
+        async->log = NULL;
+        return false;
+    }
+    async->running = true;
+
+    return true;
+}
+
+static void *hashtable_async_free_run(void *arg) {
+    hashtable_async *async = arg;
+
+    if (async->old.table) {
+        hashtable_release_buckets(&async->old);
+    }
+    if (async->old.bloom) {
+        hashtable_bloom_free(async->old.bloom);
+    }
+    if (async->oldLog) {
+        hashtable_destroy(async->oldLog);
+    }
+
+    __atomic_store_n(&async->freed, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// join the thread freeing what the last expansion replaced, if it is done
+// or wait is set
+static void hashtable_async_reap(hashtable_ctx *ctx, bool wait) {
+    hashtable_async *async = ctx->async;
+
+    if (async->freeing && (wait || __atomic_load_n(&async->freed, __ATOMIC_ACQUIRE))) {
+        pthread_join(async->freeThread, NULL);
+        async->freeing = false;
+        // the table may have been forked since, and its bytes counted for the family
+        HASHTABLE_STATS_MEMORY(ctx, async->oldStats.bytes_allocated);
+    }
+}
+
+// free the buckets and filter of old (both may be NULL) and the log an
+// expansion is done with on a thread of their own, or right away when the
+// thread cannot be created
+static void hashtable_async_free(hashtable_ctx *ctx, const hashtable_ctx *old, hashtable_ctx *log) {
+    hashtable_async *async = ctx->async;
+
+    // long done by now, expansions are far apart
+    hashtable_async_reap(ctx, true);
+
+    // charges the family like ctx would, its own statistics otherwise
+    memset(&async->oldStats, 0, sizeof(async->oldStats));
+    async->old.table = old->table;
+    async->old.table_refs = old->table_refs;
+    async->old.overlay = old->overlay;
+    async->old.size = old->size;
+    async->old.allocator = ctx->allocator;
+    async->old.stats = &async->oldStats;
+    async->old.family = ctx->family;
+    async->old.bloom = old->bloom;
+    async->oldLog = log;
+    async->freed = false;
+
+    async->freeing = 0 == pthread_create(&async->freeThread, NULL, hashtable_async_free_run, async);
+    if (!async->freeing) {
+        hashtable_async_free_run(async);
+        HASHTABLE_STATS_MEMORY(ctx, async->oldStats.bytes_allocated);
+    }
+}
+
+// wait for a running expansion and swap in its result
+static void hashtable_async_finish(hashtable_ctx *ctx) {
+    hashtable_async *async = ctx->async;
+    hashtable_ctx old = {.size = ctx->size};
+
+    pthread_join(async->thread, NULL);
+    async->running = false;
+
+    if (NULL == async->newTable) {
+        // the log is replayed onto the old array
+        return;
+    }
+
+    old.table = ctx->table;
+    old.table_refs = ctx->table_refs;
+    old.overlay = ctx->overlay;
+    if (async->newBloom) {
+        old.bloom = hashtable_bloom_replace(ctx, async->newBloom);
+    }
+    ctx->table = async->newTable;
+    ctx->table_refs = NULL;
+    ctx->overlay = NULL;
+    ctx->size = async->newSize;
+
+    HASHTABLE_STATS_MEMORY(ctx, async->stats.bytes_allocated);
+    HASHTABLE_STATS_ADD(ctx, expansions, 1);
+    HASHTABLE_STATS_ADD(ctx, expand_ns, async->ns);
+
+    hashtable_async_free(ctx, &old, NULL);
+}
+
+// whether an expansion keeps a log, which gets look through first
+static bool hashtable_async_logging(hashtable_ctx *ctx) {
+    return ctx->async && ctx->async->log;
+}
+
+// grow a table past the throttle, on a background thread when enabled
+static void hashtable_grow(hashtable_ctx *ctx) {
+    if (NULL == ctx->async || false == hashtable_async_start(ctx, get_next_prime(ctx->size + 1))) {
+        hashtable_expand(ctx, get_next_prime(ctx->size + 1));
+    }
+}
+
+// replay up to count entries of the log onto the buckets, scanning at most
+// HASHTABLE_REPLAY_SCAN times as many buckets of the log, and let go of the
+// log once it is empty
+static void hashtable_async_replay(hashtable_ctx *ctx, size_t count) {
+    hashtable_async *async = ctx->async;
+    hashtable_ctx *log = async->log;
+    size_t scan = count < SIZE_MAX / HASHTABLE_REPLAY_SCAN ? count * HASHTABLE_REPLAY_SCAN : SIZE_MAX;
+    // the count of the table already includes the log
+    size_t used = ctx->used;
+    hashtable_entry *entry;
+
+    while (log->used && count && scan) {
+        entry = log->table[async->replayed];
+        if (NULL == entry) {
+            async->replayed++;
+            scan--;
+            continue;
+        }
+
+        if (&hashtable_tombstone == entry->value) {
+            hashtable_remove(ctx, entry->key);
+        } else {
+            hashtable_put(ctx, entry->key, entry->value);
+        }
+        log->table[async->replayed] = entry->next;
+        hashtable_free_entry(log, entry);
+        log->used--;
+        count--;
+    }
+    ctx->used = used;
+
+    if (0 == log->used) {
+        async->log = NULL;
+        // the previous expansion is long freed, unless the log was short
+        hashtable_async_reap(ctx, false);
+        if (async->freeing) {
+            hashtable_destroy(log);
+        } else {
+            hashtable_ctx none = {.size = 0};
+            hashtable_async_free(ctx, &none, log);
+        }
+        // held back while the log was replayed
+        if (hashtable_need_expand(ctx)) {
+            hashtable_grow(ctx);
+        }
+    }
+}
+
+void hashtable_async_wait(hashtable_ctx *ctx) {
+    // replaying the log may start the next expansion
+    while (hashtable_async_logging(ctx)) {
+        if (ctx->async->running) {
+            hashtable_async_finish(ctx);
+        }
+        hashtable_async_replay(ctx, SIZE_MAX);
+    }
+}
+
+// on every write: swap in the result of a finished expansion, then replay
+// a few entries of the log
+static void hashtable_async_step(hashtable_ctx *ctx) {
+    hashtable_async *async = ctx->async;
+
+    if (async->running) {
+        if (__atomic_load_n(&async->done, __ATOMIC_ACQUIRE)) {
+            hashtable_async_finish(ctx);
+        } else {
+            return;
+        }
+    }
+    if (async->log) {
+        hashtable_async_replay(ctx, HASHTABLE_REPLAY_ENTRIES);
+    }
+}
+
+// whether key is in the table, looking through the log first
+static bool hashtable_async_exists(hashtable_ctx *ctx, const char *key) {
+    hashtable_entry *entry = hashtable_find(ctx->async->log, key);
+
+    if (entry) {
+        return &hashtable_tombstone != entry->value;
+    }
+
+    return NULL != hashtable_find(ctx, key);
+}
+
+// set key while an expansion runs or its log is replayed
+static bool hashtable_async_set(hashtable_ctx *ctx, const char *key, void *value) {
+    hashtable_async *async = ctx->async;
+    bool exists = hashtable_async_exists(ctx, key);
+    size_t used = ctx->used;
+
+    if (async->running) {
+        if (false == hashtable_set(async->log, key, value)) {
+            return false;
+        }
+    } else {
+        if (false == hashtable_put(ctx, key, value)) {
+            ctx->used = used;
+            return false;
+        }
+        hashtable_delete(async->log, key);
+    }
+
+    ctx->used = used + !exists;
+    return true;
+}
+
+// delete key while an expansion runs or its log is replayed
+static bool hashtable_async_delete(hashtable_ctx *ctx, const char *key) {
+    hashtable_async *async = ctx->async;
+    size_t used = ctx->used;
+
+    if (!hashtable_async_exists(ctx, key)) {
+        return false;
+    }
+
+    if (async->running) {
+        if (false == hashtable_set(async->log, key, &hashtable_tombstone)) {
+            return false;
+        }
+    } else {
+        if (hashtable_find(ctx, key) && false == hashtable_remove(ctx, key)) {
+            ctx->used = used;
+            return false;
+        }
+        hashtable_delete(async->log, key);
+    }
+
+    ctx->used = used - 1;
+    return true;
+}
+
+bool hashtable_async_expand(hashtable_ctx *ctx, bool enable) {
+    if (enable) {
+        if (NULL == ctx->async) {
+            ctx->async = calloc(1, sizeof(hashtable_async));
+            if (NULL == ctx->async) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if (ctx->async) {
+        hashtable_async_wait(ctx);
+        hashtable_async_reap(ctx, true);
+        free(ctx->async);
+        ctx->async = NULL;
+    }
+
+    return true;
+}
+
+bool hashtable_bloom_filter(hashtable_ctx *ctx, bool enable) {
+    hashtable_async_wait(ctx);
+
+    if (enable) {
+        return ctx->bloom || hashtable_bloom_rebuild(ctx);
+    }
+
+    if (ctx->bloom) {
+        hashtable_bloom_free(ctx->bloom);
+        ctx->bloom = NULL;
+    }
+
+    return true;
+}
+
+bool hashtable_bloom_stats(hashtable_ctx *ctx, hashtable_bloom_statistics *stats) {
+    hashtable_bloom *bloom = ctx->bloom;
+
+    if (NULL == bloom) {
+        return false;
+    }
+
+    stats->lookups = bloom->lookups;
+    stats->negatives = bloom->negatives;
+    stats->false_positives = bloom->falsePositives;
+    stats->false_positive_rate = bloom->negatives + bloom->falsePositives ?
+        (double)bloom->falsePositives / (bloom->negatives + bloom->falsePositives) : 0;
+    stats->stale = bloom->stale;
+    stats->bytes = bloom->count * sizeof(*bloom->blocks);
+
+    return true;
+}
+
+hashtable_ctx *hashtable_new(size_t size) {
+    return hashtable_new_with_allocator(size, NULL);
+}
+
+hashtable_ctx *hashtable_new_with_allocator(size_t size, const hashtable_allocator *allocator) {
+    hashtable_ctx *ctx = calloc(1, sizeof(hashtable_ctx));
+    if (NULL == ctx) {
+        return NULL;
+    }
+
+    size = get_next_prime(size);
+    ctx->size = size;
+    ctx->used = 0;
+    ctx->allocator = allocator ? *allocator : hashtable_default_allocator;
+
+#ifdef HASHTABLE_STATS
+    ctx->stats = calloc(1, sizeof(hashtable_statistics));
+    if (NULL == ctx->stats) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->stats->bytes_allocated = sizeof(hashtable_ctx) + sizeof(hashtable_statistics);
+#endif
+
+    ctx->table = hashtable_node_new(ctx, ctx->size * sizeof(hashtable_entry *), true);
+    if (NULL == ctx->table) {
+        free(ctx->stats);
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+hashtable_ctx *hashtable_fork(hashtable_ctx *ctx) {
+    hashtable_async_wait(ctx);
+
+    hashtable_ctx *fork = calloc(1, sizeof(hashtable_ctx));
+    if (NULL == fork) {
+        return NULL;
+    }
+
+#ifdef HASHTABLE_STATS
+    fork->stats = calloc(1, sizeof(hashtable_statistics));
+    if (NULL == fork->stats) {
+        free(fork);
+        return NULL;
+    }
+    fork->stats->bytes_allocated = sizeof(hashtable_ctx) + sizeof(hashtable_statistics);
+#endif
+
+    if (ctx->bloom) {
+        fork->bloom = hashtable_bloom_share(ctx->bloom);
+        if (NULL == fork->bloom) {
+            free(fork->stats);
+            free(fork);
+            return NULL;
+        }
+    }
+
+    if (NULL == ctx->family) {
+        ctx->family = malloc(sizeof(hashtable_family));
+        if (NULL == ctx->family) {
+            if (fork->bloom) {
+                hashtable_bloom_free(fork->bloom);
+            }
+            free(fork->stats);
+            free(fork);
+            return NULL;
+        }
+        ctx->family->tables = 1;
+        ctx->family->bytes = 0;
+#ifdef HASHTABLE_STATS
+        // from now on the pages and entries are counted for the family
+        ctx->family->bytes = ctx->stats->bytes_allocated - sizeof(hashtable_ctx) - sizeof(hashtable_statistics);
+        ctx->stats->bytes_allocated = sizeof(hashtable_ctx) + sizeof(hashtable_statistics);
+#endif
+    }
+    if (NULL == ctx->table_refs) {
+        ctx->table_refs = malloc(sizeof(size_t));
+        if (NULL == ctx->table_refs) {
+            if (fork->bloom) {
+                hashtable_bloom_free(fork->bloom);
+            }
+            free(fork->stats);
+            free(fork);
+            return NULL;
+        }
+        *ctx->table_refs = 1;
+    }
+    __atomic_add_fetch(&ctx->family->tables, 1, __ATOMIC_RELAXED);
+    hashtable_retain_node(ctx->table_refs);
+    if (ctx->overlay) {
+        hashtable_retain_node(&ctx->overlay->refs);
+    }
+
+    fork->allocator = ctx->allocator;
+    fork->used = ctx->used;
+    fork->size = ctx->size;
+    fork->table = ctx->table;
+    fork->table_refs = ctx->table_refs;
+    fork->overlay = ctx->overlay;
+    fork->family = ctx->family;
+
+    return fork;
+}
+
+void hashtable_destroy(hashtable_ctx *ctx) {
+    if (ctx->async) {
+        hashtable_async_expand(ctx, false);
+    }
+
+    hashtable_release_buckets(ctx);
+    // the last table of a family frees it
+    if (ctx->family && 0 == __atomic_sub_fetch(&ctx->family->tables, 1, __ATOMIC_ACQ_REL)) {
+        free(ctx->family);
+    }
+    if (ctx->bloom) {
+        hashtable_bloom_free(ctx->bloom);
+    }
+    free(ctx->stats);
+    free(ctx);
+}
+
+hashtable_entry *hashtable_chain(const hashtable_ctx *ctx, size_t index) {
+    return *hashtable_bucket(ctx, index);
+}
+
+bool hashtable_set(hashtable_ctx *ctx, const char *key, void *value) {
+    if (ctx->async) {
+        hashtable_async_step(ctx);
+        if (ctx->async->log) {
+            return hashtable_async_set(ctx, key, value);
+        }
+    }
+
+    return hashtable_put(ctx, key, value);
+}
+
+// set key in the buckets, past the log of an async expansion
+static bool hashtable_put(hashtable_ctx *ctx, const char *key, void *value) {
+    uint32_t hash = hashtable_key_hash(key);
+    uint32_t index = hash % ctx->size;
+
+    hashtable_entry *current = *hashtable_bucket(ctx, index);
+    bool shared = hashtable_bucket_shared(ctx, index);
+
+    while (current) {
+        shared = shared || hashtable_entry_shared(current);
+        if (0 == strcmp(current->key, key)) {
+            if (shared) {
+                hashtable_entry **link = hashtable_unshare_chain(ctx, hashtable_bucket_write(ctx, index), key);
+                if (NULL == link) {
+                    return false;
+                }
+                current = *link;
+            }
+            current->value = value;
+            return true;
+        }
+        current = current->next;
+    }
+
+    hashtable_entry **bucket = hashtable_bucket_write(ctx, index);
+    if (NULL == bucket) {
+        return false;
+    }
+    hashtable_entry *newItem = hashtable_new_entry(ctx, key, strlen(key) + 1, value);
+    if (NULL == newItem) {
+        return false;
+    }
+
+    ctx->used++;
+    newItem->next = *bucket;
+    *bucket = newItem;
+    if (ctx->bloom) {
+        hashtable_bloom_add(ctx->bloom, hash);
+    }
+
+    // not while the log of the last expansion is replayed onto the buckets
+    if (hashtable_need_expand(ctx) && !hashtable_async_logging(ctx)) {
+        hashtable_grow(ctx);
+    }
+
+    return true;
+}
+
+// look key up in the buckets, once its hash is known
+static void *hashtable_lookup(hashtable_ctx *ctx, const char *key, uint32_t hash) {
+    if (ctx->bloom) {
+#ifdef HASHTABLE_STATS
+        ctx->bloom->lookups++;
+#endif
+        if (!hashtable_bloom_contains(ctx->bloom, hash)) {
+#ifdef HASHTABLE_STATS
+            ctx->bloom->negatives++;
+            hashtable_stats_probe(ctx, 0, false);
+#endif
+            return NULL;
+        }
+    }
+
+    hashtable_entry *current = *hashtable_bucket(ctx, hash % ctx->size);
+#ifdef HASHTABLE_STATS
+    uint64_t probes = 0;
+#endif
+
+    while (current) {
+#ifdef HASHTABLE_STATS
+        probes++;
+#endif
+        if (0 == strcmp(current->key, key)) {
+#ifdef HASHTABLE_STATS
+            hashtable_stats_probe(ctx, probes, true);
+#endif
+            return current->value;
+        }
+        current = current->next;
+    }
+
+#ifdef HASHTABLE_STATS
+    if (ctx->bloom) {
+        ctx->bloom->falsePositives++;
+    }
+    hashtable_stats_probe(ctx, probes, false);
+#endif
+    return NULL;
+}
+
+void *hashtable_get(hashtable_ctx *ctx, const char *key) {
+    if (hashtable_async_logging(ctx)) {
+        hashtable_entry *entry = hashtable_find(ctx->async->log, key);
+        if (entry) {
+            return &hashtable_tombstone == entry->value ? NULL : entry->value;
+        }
+    }
+
+    return hashtable_lookup(ctx, key, hashtable_key_hash(key));
+}
+
+void hashtable_get_batch(hashtable_ctx *ctx, const char *const *keys, size_t count, void **values) {
+    size_t lens[HASHTABLE_BATCH];
+    uint32_t hashes[HASHTABLE_BATCH];
+    hashtable_entry *heads[HASHTABLE_BATCH];
+    size_t start;
+    size_t n;
+    size_t i;
+
+    if (hashtable_async_logging(ctx)) {
+        for (i = 0; i < count; i++) {
+            values[i] = hashtable_get(ctx, keys[i]);
+        }
+        return;
+    }
+
+    for (start = 0; start < count; start += n) {
+        n = count - start < HASHTABLE_BATCH ? count - start : HASHTABLE_BATCH;
+
+        for (i = 0; i < n; i++) {
+            lens[i] = strlen(keys[start + i]);
+        }
+        MurmurHash2Batch(keys + start, lens, n, hashes);
+
+        // overlap the cache misses of the whole batch: buckets, then chain heads
+        for (i = 0; i < n; i++) {
+            HASHTABLE_PREFETCH(hashtable_bucket(ctx, hashes[i] % ctx->size));
+            if (ctx->bloom) {
+                HASHTABLE_PREFETCH(hashtable_bloom_block(ctx->bloom, hashes[i]));
+            }
+        }
+        for (i = 0; i < n; i++) {
+            heads[i] = *hashtable_bucket(ctx, hashes[i] % ctx->size);
+            if (heads[i]) {
+                HASHTABLE_PREFETCH(heads[i]);
+            }
+        }
+
+        for (i = 0; i < n; i++) {
+            values[start + i] = hashtable_lookup(ctx, keys[start + i], hashes[i]);
+        }
+    }
+}
+
+bool hashtable_delete(hashtable_ctx *ctx, const char *key) {
+    if (ctx->async) {
+        hashtable_async_step(ctx);
+        if (ctx->async->log) {
+            return hashtable_async_delete(ctx, key);
+        }
+    }
+
+    return hashtable_remove(ctx, key);
+}
+
+// delete key from the buckets, past the log of an async expansion
+static bool hashtable_remove(hashtable_ctx *ctx, const char *key) {
+    uint32_t index = hashtable_key_hash(key) % ctx->size;
+
+    hashtable_entry **link = hashtable_bucket(ctx, index);
+    hashtable_entry *current;
+    bool shared = hashtable_bucket_shared(ctx, index);
+
+    while ((current = *link)) {
+        shared = shared || hashtable_entry_shared(current);
+        if (0 == strcmp(current->key, key)) {
+            if (shared) {
+                link = hashtable_unshare_chain(ctx, hashtable_bucket_write(ctx, index), key);
+                if (NULL == link) {
+                    return false;
+                }
+                current = *link;
+            }
+            // the reference current held on next moves to link
+            *link = current->next;
+            hashtable_free_entry(ctx, current);
+            ctx->used--;
+            if (ctx->bloom && ++ctx->bloom->stale > ctx->bloom->capacity / 2) {
+                // a failed rebuild leaves the current filter, still correct
+                hashtable_bloom_rebuild(ctx);
+            }
+            return true;
+        }
+        link = &current->next;
+    }
+
+    return false;
+}
+
+// relink the entries of the first size buckets of table into the first
+// newSize, either of them being the size of the array
+static void hashtable_rehash(hashtable_entry **table, size_t size, size_t newSize, hashtable_bloom *bloom) {
+    hashtable_entry *current;
+    hashtable_entry *next;
+    size_t i;
+    size_t index;
+    uint32_t hash;
+
+    for (i = 0; i < size; i++) {
+        current = table[i];
+        table[i] = NULL;
+        while (current) {
+            next = current->next;
+            hash = hashtable_key_hash(current->key);
+            index = hash % newSize;
+            current->next = table[index];
+            table[index] = current;
+            if (bloom) {
+                hashtable_bloom_add(bloom, hash);
+            }
+            current = next;
+        }
+    }
+}
+
+bool hashtable_expand(hashtable_ctx *ctx, size_t size) {
+    hashtable_async_wait(ctx);
+
+    size = get_next_prime(size);
+
+    if (ctx->size == size) {
+        return false;
+    }
+
+    if ((ctx->used * 100 / size) > HASHTABLE_EXPAND_THROTTLE) {
+        return false;
+    }
+
+#ifdef HASHTABLE_STATS
+    uint64_t start = hashtable_now_ns();
+#endif
+
+    // entries shared with a fork cannot be relinked, copy them first
+    if (false == hashtable_unshare_all(ctx)) {
+        return false;
+    }
+
+    // the bucket array is resized in place, so that an allocator able to
+    // move pages never holds both arrays at once
+    hashtable_entry **table = ctx->table;
+    if (size > ctx->size) {
+        table = ctx->allocator.realloc(ctx->allocator.ctx, table, ctx->size * sizeof(hashtable_entry *),
+                                       size * sizeof(hashtable_entry *));
+        if (NULL == table) {
+            return false;
+        }
+        memset(table + ctx->size, 0, (size - ctx->size) * sizeof(hashtable_entry *));
+        ctx->table = table;
+    }
+
+    // a failed allocation keeps the current filter, still correct for fewer buckets
+    hashtable_bloom *bloom = ctx->bloom ? hashtable_bloom_new(size) : NULL;
+
+    hashtable_rehash(table, ctx->size, size, bloom);
+
+    if (size < ctx->size) {
+        table = ctx->allocator.realloc(ctx->allocator.ctx, table, ctx->size * sizeof(hashtable_entry *),
+                                       size * sizeof(hashtable_entry *));
+        if (NULL == table) {
+            // move the entries back into the array that could not shrink
+            hashtable_rehash(ctx->table, size, ctx->size, NULL);
+            if (bloom) {
+                hashtable_bloom_free(bloom);
+            }
+            return false;
+        }
+    }
+    if (bloom) {
+        hashtable_bloom_free(hashtable_bloom_replace(ctx, bloom));
+    }
+
+    HASHTABLE_STATS_MEMORY(ctx, ((int64_t)size - (int64_t)ctx->size) * (int64_t)sizeof(hashtable_entry *));
+
+    ctx->size = size;
+    ctx->table = table;
+
+    HASHTABLE_STATS_ADD(ctx, expansions, 1);
+    HASHTABLE_STATS_ADD(ctx, expand_ns, hashtable_now_ns() - start);
+
+    return true;
+}
+
+bool hashtable_resize(hashtable_ctx *ctx) {
+    // should not overflow
+    if ((ctx->used < 1) < ctx->used) {
+        return false;
+    }
+
+    // ensure used/size < 50%
+    size_t size = get_next_prime(ctx->used < 1);
+    if (size >= ctx->size) {
+        return false;
+    }
+
+    return hashtable_expand(ctx, size);
+}
+
+// Parallel bulk operations: every worker owns one range of pages of buckets
+// and sees the table through a private context, which shares the buckets
+// but keeps its own statistics. The statistics and counts of the workers are
+// added to the table once they are all done.
+
+typedef struct __hashtable_worker {
+    hashtable_ctx ctx;
+    hashtable_statistics stats;
+    size_t index;
+    size_t count;
+    pthread_t thread;
+    bool started;
+
+    hashtable_foreach_fn foreach;
+    hashtable_filter_fn filter;
+    hashtable_merge_fn conflict;
+    void *arg;
+
+    // merge: the source table, and the copies of its entries this worker
+    // made for each range of the destination
+    hashtable_ctx *src;
+    struct __hashtable_worker *workers;
+    hashtable_entry **incoming;
+    hashtable_bloom *bloom;
+
+    size_t added;
+    size_t removed;
+    bool failed;
+} hashtable_worker;
+
+static size_t hashtable_parallel_threads(size_t nthreads, size_t size) {
+    if (0 == nthreads) {
+#ifdef _SC_NPROCESSORS_ONLN
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? cpus : 1;
+#else
+        nthreads = 1;
+#endif
+    }
+
+    size_t most = size / HASHTABLE_PARALLEL_MIN_BUCKETS + 1;
+    return nthreads < most ? nthreads : most;
+}
+
+// first bucket of a range, range count being one past the last bucket.
+// ranges are made of whole pages, so that no two workers copy the same one
+static size_t hashtable_range_start(size_t range, size_t count, size_t size) {
+    size_t page = ((uint64_t)range * hashtable_page_count(size) + count - 1) / count;
+    size_t start = page << HASHTABLE_PAGE_BITS;
+
+    return start < size ? start : size;
+}
+
+// the range holding a bucket
+static size_t hashtable_range(size_t index, size_t count, size_t size) {
+    return (uint64_t)(index >> HASHTABLE_PAGE_BITS) * count / hashtable_page_count(size);
+}
+
+static hashtable_worker *hashtable_workers_new(hashtable_ctx *ctx, size_t count) {
+    hashtable_worker *workers = calloc(count, sizeof(hashtable_worker));
+    size_t i;
+
+    if (NULL == workers) {
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        workers[i].ctx.size = ctx->size;
+        workers[i].ctx.table = ctx->table;
+        workers[i].ctx.table_refs = ctx->table_refs;
+        workers[i].ctx.overlay = ctx->overlay;
+        workers[i].ctx.allocator = ctx->allocator;
+        workers[i].ctx.family = ctx->family;
+        workers[i].ctx.stats = &workers[i].stats;
+        workers[i].index = i;
+        workers[i].count = count;
+        workers[i].workers = workers;
+    }
+
+    return workers;
+}
+
+// add up what the workers did to the table and free them.
+// return false if any of them failed
+static bool hashtable_workers_free(hashtable_ctx *ctx, hashtable_worker *workers) {
+    size_t removed = 0;
+    bool success = true;
+    size_t i;
+
+    for (i = 0; i < workers->count; i++) {
+        ctx->used += workers[i].added;
+        ctx->used -= workers[i].removed;
+        removed += workers[i].removed;
+        // counts that went below zero wrap around, the sum is still right
+        HASHTABLE_STATS_MEMORY(ctx, workers[i].stats.bytes_allocated);
+        success = success && !workers[i].failed;
+        free(workers[i].incoming);
+    }
+    free(workers);
+
+    if (ctx->bloom && removed) {
+        ctx->bloom->stale += removed;
+        if (ctx->bloom->stale > ctx->bloom->capacity / 2) {
+            hashtable_bloom_rebuild(ctx);
+        }
+    }
+
+    return success;
+}
+
+// run every worker on a thread of its own, the first one on the calling
+// thread, which also runs the workers whose thread could not be created
+static void hashtable_workers_run(hashtable_worker *workers, void *(*run)(void *)) {
+    size_t i;
+
+    for (i = 1; i < workers->count; i++) {
+        workers[i].started = 0 == pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    run(&workers[0]);
+    for (i = 1; i < workers->count; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        } else {
+            run(&workers[i]);
+        }
+    }
+}
+
+static void *hashtable_foreach_run(void *arg) {
+    hashtable_worker *w = arg;
+    size_t end = hashtable_range_start(w->index + 1, w->count, w->ctx.size);
+    hashtable_entry *current;
+    size_t i;
+
+    for (i = hashtable_range_start(w->index, w->count, w->ctx.size); i < end; i++) {
+        for (current = *hashtable_bucket(&w->ctx, i); current; current = current->next) {
+            w->foreach(current->key, current->value, w->arg);
+        }
+    }
+
+    return NULL;
+}
+
+bool hashtable_parallel_foreach(hashtable_ctx *ctx, hashtable_foreach_fn fn, void *arg, size_t nthreads) {
+    hashtable_async_wait(ctx);
+
+    hashtable_worker *workers = hashtable_workers_new(ctx, hashtable_parallel_threads(nthreads, ctx->size));
+    size_t i;
+
+    if (NULL == workers) {
+        return false;
+    }
+    for (i = 0; i < workers->count; i++) {
+        workers[i].foreach = fn;
+        workers[i].arg = arg;
+    }
+
+    hashtable_workers_run(workers, hashtable_foreach_run);
+    return hashtable_workers_free(ctx, workers);
+}
+
+static void *hashtable_filter_run(void *arg) {
+    hashtable_worker *w = arg;
+    size_t end = hashtable_range_start(w->index + 1, w->count, w->ctx.size);
+    hashtable_entry **link;
+    hashtable_entry *current;
+    size_t removed = 0;
+    size_t i;
+    bool shared;
+
+    for (i = hashtable_range_start(w->index, w->count, w->ctx.size); i < end && !w->failed; i++) {
+        link = hashtable_bucket(&w->ctx, i);
+        shared = hashtable_bucket_shared(&w->ctx, i);
+
+        while ((current = *link)) {
+            shared = shared || hashtable_entry_shared(current);
+            if (w->filter(current->key, current->value, w->arg)) {
+                link = &current->next;
+                continue;
+            }
+
+            // as in hashtable_delete
+            if (shared) {
+                link = hashtable_unshare_chain(&w->ctx, hashtable_page_write(&w->ctx, i), current->key);
+                if (NULL == link) {
+                    w->failed = true;
+                    break;
+                }
+                current = *link;
+                shared = false;
+            }
+            *link = current->next;
+            hashtable_free_entry(&w->ctx, current);
+            removed++;
+        }
+    }
+    w->removed = removed;
+
+    return NULL;
+}
+
+bool hashtable_filter(hashtable_ctx *ctx, hashtable_filter_fn keep, void *arg, size_t nthreads) {
+    hashtable_async_wait(ctx);
+    if (false == hashtable_unshare_buckets(ctx)) {
+        return false;
+    }
+
+    hashtable_worker *workers = hashtable_workers_new(ctx, hashtable_parallel_threads(nthreads, ctx->size));
+    size_t i;
+
+    if (NULL == workers) {
+        return false;
+    }
+    for (i = 0; i < workers->count; i++) {
+        workers[i].filter = keep;
+        workers[i].arg = arg;
+    }
+
+    hashtable_workers_run(workers, hashtable_filter_run);
+    return hashtable_workers_free(ctx, workers);
+}
+
+// merge, first phase: copy the entries of a range of the source, sorting
+// the copies by the range of the destination they belong to. a copy is
+// reachable from no table until it is linked, so it keeps its hash in refs
+static void *hashtable_merge_split_run(void *arg) {
+    hashtable_worker *w = arg;
+    hashtable_ctx *src = w->src;
+    size_t end = hashtable_range_start(w->index + 1, w->count, src->size);
+    hashtable_entry *current;
+    hashtable_entry *copy;
+    size_t keyLen;
+    size_t range;
+    size_t i;
+
+    for (i = hashtable_range_start(w->index, w->count, src->size); i < end; i++) {
+        for (current = *hashtable_bucket(src, i); current; current = current->next) {
+            keyLen = strlen(current->key);
+            copy = hashtable_new_entry(&w->ctx, current->key, keyLen + 1, current->value);
+            if (NULL == copy) {
+                w->failed = true;
+                return NULL;
+            }
+            copy->refs = MurmurHash2(copy->key, keyLen);
+            range = hashtable_range(copy->refs % w->ctx.size, w->count, w->ctx.size);
+            copy->next = w->incoming[range];
+            w->incoming[range] = copy;
+        }
+    }
+
+    return NULL;
+}
+
+// merge, second phase: link the copies every worker made for this range
+static void *hashtable_merge_insert_run(void *arg) {
+    hashtable_worker *w = arg;
+    hashtable_entry **link;
+    hashtable_entry *current;
+    hashtable_entry *copy;
+    hashtable_entry *next;
+    size_t added = 0;
+    size_t index;
+    size_t i;
+    uint32_t hash;
+    bool shared;
+
+    for (i = 0; i < w->count; i++) {
+        copy = w->workers[i].incoming[w->index];
+        w->workers[i].incoming[w->index] = NULL;
+
+        for (; copy; copy = next) {
+            next = copy->next;
+            hash = copy->refs;
+            copy->refs = 1;
+            index = hash % w->ctx.size;
+
+            shared = hashtable_bucket_shared(&w->ctx, index);
+            for (current = *hashtable_bucket(&w->ctx, index); current; current = current->next) {
+                shared = shared || hashtable_entry_shared(current);
+                if (0 == strcmp(current->key, copy->key)) {
+                    break;
+                }
+            }
+
+            if (NULL == current) {
+                link = hashtable_page_write(&w->ctx, index);
+                if (NULL == link) {
+                    w->failed = true;
+                    hashtable_free_entry(&w->ctx, copy);
+                    continue;
+                }
+                copy->next = *link;
+                *link = copy;
+                added++;
+                if (w->bloom) {
+                    hashtable_bloom_add_atomic(w->bloom, hash);
+                }
+                continue;
+            }
+
+            void *value = w->conflict ? w->conflict(copy->key, current->value, copy->value, w->arg) : copy->value;
+            if (shared) {
+                link = hashtable_unshare_chain(&w->ctx, hashtable_page_write(&w->ctx, index), copy->key);
+                if (NULL == link) {
+                    w->failed = true;
+                    hashtable_free_entry(&w->ctx, copy);
+                    continue;
+                }
+                current = *link;
+            }
+            current->value = value;
+            hashtable_free_entry(&w->ctx, copy);
+        }
+    }
+    w->added = added;
+
+    return NULL;
+}
+
+bool hashtable_merge(hashtable_ctx *dst, hashtable_ctx *src, hashtable_merge_fn conflict, void *arg,
+                     size_t nthreads) {
+    if (dst == src) {
+        return false;
+    }
+
+    hashtable_async_wait(dst);
+    hashtable_async_wait(src);
+
+    // presize, so that the copies are linked straight into their final bucket
+    size_t size = (dst->used + src->used) * 100 / HASHTABLE_EXPAND_THROTTLE + 1;
+    if (get_next_prime(size) > dst->size && false == hashtable_expand(dst, size)) {
+        return false;
+    }
+    if (false == hashtable_unshare_buckets(dst)) {
+        return false;
+    }
+
+    size = dst->size > src->size ? dst->size : src->size;
+    hashtable_worker *workers = hashtable_workers_new(dst, hashtable_parallel_threads(nthreads, size));
+    hashtable_entry *copy;
+    size_t i;
+    size_t j;
+    bool failed = false;
+
+    if (NULL == workers) {
+        return false;
+    }
+    for (i = 0; i < workers->count; i++) {
+        workers[i].conflict = conflict;
+        workers[i].arg = arg;
+        workers[i].src = src;
+        workers[i].bloom = dst->bloom;
+        workers[i].incoming = calloc(workers->count, sizeof(hashtable_entry *));
+        failed = failed || NULL == workers[i].incoming;
+    }
+
+    if (!failed) {
+        hashtable_workers_run(workers, hashtable_merge_split_run);
+        for (i = 0; i < workers->count; i++) {
+            failed = failed || workers[i].failed;
+        }
+    }
+
+    if (failed) {
+        for (i = 0; i < workers->count; i++) {
+            for (j = 0; workers[i].incoming && j < workers->count; j++) {
+                while ((copy = workers[i].incoming[j])) {
+                    workers[i].incoming[j] = copy->next;
+                    hashtable_free_entry(&workers[i].ctx, copy);
+                }
+            }
+        }
+        hashtable_workers_free(dst, workers);
+        return false;
+    }
+
+    hashtable_workers_run(workers, hashtable_merge_insert_run);
+    return hashtable_workers_free(dst, workers);
+}
+
+bool hashtable_stats(hashtable_ctx *ctx, hashtable_statistics *stats) {
+#ifdef HASHTABLE_STATS
+    size_t i;
+    size_t length;
+    hashtable_entry *current;
+
+    if (ctx->async) {
+        hashtable_async_reap(ctx, false);
+    }
+
+    *stats = *ctx->stats;
+    stats->shared_bytes = ctx->family ? __atomic_load_n(&ctx->family->bytes, __ATOMIC_RELAXED) : 0;
+    stats->avg_probes = stats->gets ? (double)stats->probes / stats->gets : 0;
+    stats->hit_ratio = stats->gets ? (double)stats->hits / stats->gets : 0;
+    stats->max_chain_length = 0;
+    memset(stats->chain_lengths, 0, sizeof(stats->chain_lengths));
+
+    for (i = 0; i < ctx->size; i++) {
+        length = 0;
+        for (current = *hashtable_bucket(ctx, i); current; current = current->next) {
+            length++;
+        }
+        if (length > stats->max_chain_length) {
+            stats->max_chain_length = length;
+        }
+        if (length >= HASHTABLE_STATS_CHAIN_SLOTS) {
+            length = HASHTABLE_STATS_CHAIN_SLOTS - 1;
+        }
+        stats->chain_lengths[length]++;
+    }
+
+    return true;
+#else
+    return false;
+#endif
 }
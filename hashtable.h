@@ -8,32 +8,297 @@
 typedef struct __hashtable_entry {
     struct __hashtable_entry *next;
     void *value;
+    uint32_t refs;
     char key[0];
 } hashtable_entry;
 
+// number of slots in hashtable_statistics.chain_lengths, the last slot
+// counts every chain at least that long
+#define HASHTABLE_STATS_CHAIN_SLOTS 16
+
+typedef struct {
+    // maintained by the hot paths
+    uint64_t gets;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t probes;            // keys compared by all gets
+    uint64_t max_probes;        // keys compared by the longest get
+    uint64_t expansions;
+    uint64_t expand_ns;         // total time spent in hashtable_expand
+    uint64_t bytes_allocated;   // bytes currently held by the table alone
+    uint64_t shared_bytes;      // pages and entries of a forked table and its forks
+
+    // computed by hashtable_stats
+    double avg_probes;
+    double hit_ratio;
+    size_t max_chain_length;
+    size_t chain_lengths[HASHTABLE_STATS_CHAIN_SLOTS];
+} hashtable_statistics;
+
+typedef struct __hashtable_overlay hashtable_overlay;
+typedef struct __hashtable_family hashtable_family;
+typedef struct __hashtable_async hashtable_async;
+typedef struct __hashtable_bloom hashtable_bloom;
+
+// the counters of gets are maintained only with --enable-stats, so that
+// gets do not write to the table
+typedef struct {
+    uint64_t lookups;           // gets checked against the filter
+    uint64_t negatives;         // gets answered by the filter alone
+    uint64_t false_positives;   // gets that passed the filter and missed
+    double false_positive_rate; // false_positives / all misses that were checked
+    size_t stale;               // deleted keys still in the filter
+    size_t bytes;
+} hashtable_bloom_statistics;
+
+// Allocator of the bucket arrays and entries of a table. Every call gets
+// ctx back, and realloc and free also get the size the block was allocated
+// with. The functions may be called from any thread that uses the table,
+// from its async expansion threads and from the threads using its forks.
+// calloc returns zeroed memory; it may be NULL, in which case blocks from
+// malloc are cleared.
+typedef struct {
+    void *(*malloc)(void *ctx, size_t size);
+    void *(*calloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t oldSize, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} hashtable_allocator;
+
 typedef struct {
     size_t used;
     size_t size;
+    // the buckets. a table sharing them with a fork copies the pages it
+    // writes to into its overlay, hashtable_chain reads through both
     hashtable_entry **table;
+    hashtable_allocator allocator;
+    hashtable_statistics *stats;
+
+    // set while table is shared with a fork
+    size_t *table_refs;
+    // pages of table written since it is shared, NULL when there are none
+    hashtable_overlay *overlay;
+    // set once the table or the table it was forked from is forked
+    hashtable_family *family;
+
+    // set by hashtable_async_expand
+    hashtable_async *async;
+    // set by hashtable_bloom_filter
+    hashtable_bloom *bloom;
 } hashtable_ctx;
 
 hashtable_ctx *hashtable_new(size_t size);
 
+// like hashtable_new, allocating the buckets and entries with allocator,
+// or with malloc when allocator is NULL. forks of the table share it, so
+// it must outlive the table and all of its forks
+hashtable_ctx *hashtable_new_with_allocator(size_t size, const hashtable_allocator *allocator);
+
+// Huge page allocator: blocks of at least page_size bytes, such as the
+// bucket array of a large table, are mapped on their own with MAP_HUGETLB,
+// or when no huge page of that size is free, with ordinary pages the kernel
+// is advised to back with transparent huge pages. Such an array grows in
+// place through realloc, which moves its mapping with mremap where the
+// kernel has it. Smaller blocks up to HASHTABLE_HUGEPAGE_SMALL bytes, such
+// as the entries and the pages of buckets a forked table copies, are carved
+// out of page_size chunks mapped the same way and are recycled but never
+// unmapped before the allocator is destroyed. Blocks in between come from
+// malloc.
+
+#define HASHTABLE_HUGEPAGE_2MB ((size_t)2 << 20)
+#define HASHTABLE_HUGEPAGE_1GB ((size_t)1 << 30)
+#define HASHTABLE_HUGEPAGE_SMALL 8192
+
+typedef struct {
+    size_t hugetlb_mappings;    // mappings made with MAP_HUGETLB
+    size_t madvise_mappings;    // mappings made with ordinary pages, advised for huge pages
+    size_t mapped_bytes;        // currently mapped either way
+    size_t chunk_bytes;         // part of mapped_bytes holding small blocks
+} hashtable_hugepage_statistics;
+
+// page_size is HASHTABLE_HUGEPAGE_2MB or HASHTABLE_HUGEPAGE_1GB.
+// return NULL on failure, or where mmap is not available
+hashtable_allocator *hashtable_hugepage_new(size_t page_size);
+
+// destroy the allocator, after every table using it
+void hashtable_hugepage_destroy(hashtable_allocator *allocator);
+
+void hashtable_hugepage_stats(const hashtable_allocator *allocator, hashtable_hugepage_statistics *stats);
+
+// return a point-in-time copy of the table in O(1), or NULL on failure.
+// the copy shares the buckets and entries with ctx, and each side copies
+// only the pages of buckets and the entries it modifies afterwards. a side
+// that grows copies whatever it still shares into buckets of its own.
+// ctx and its forks may be used from different threads, but each one by a
+// single thread at a time. destroy the copy with hashtable_destroy
+hashtable_ctx *hashtable_fork(hashtable_ctx *ctx);
+
 void hashtable_destroy(hashtable_ctx *ctx);
 
+// return the first entry of the bucket at index, below ctx->size. the same
+// as ctx->table[index] unless ctx->overlay is set, which happens only once
+// the table shares its buckets with a fork and writes to them
+hashtable_entry *hashtable_chain(const hashtable_ctx *ctx, size_t index);
+
 // return true if success, otherwise return false
 bool hashtable_set(hashtable_ctx *ctx, const char *key, void *value);
 
 // return the value if success, otherwise return NULL
 void *hashtable_get(hashtable_ctx *ctx, const char *key);
 
+// look up count keys at once, storing each value (or NULL) in values.
+// the keys are hashed together with SIMD when the cpu supports it, and
+// their buckets are prefetched before any of them is walked
+void hashtable_get_batch(hashtable_ctx *ctx, const char *const *keys, size_t count, void **values);
+
 // return true if success, otherwise return false
 bool hashtable_delete(hashtable_ctx *ctx, const char *key);
 
 // return true if success, otherwise return false
 bool hashtable_resize(hashtable_ctx *ctx);
 
+// Parallel bulk operations: the buckets are split into one contiguous range
+// per thread, so that no two threads ever touch the same chain. nthreads 0
+// uses every online cpu, and small tables use fewer threads than asked for.
+// The callbacks run on several threads at once and must not use the tables
+// being worked on.
+
+typedef void (*hashtable_foreach_fn)(const char *key, void *value, void *arg);
+
+// return true to keep the entry
+typedef bool (*hashtable_filter_fn)(const char *key, void *value, void *arg);
+
+// return the value to keep for a key found in both tables
+typedef void *(*hashtable_merge_fn)(const char *key, void *dst_value, void *src_value, void *arg);
+
+// call fn for every entry of the table.
+// return false if out of memory, before fn is called
+bool hashtable_parallel_foreach(hashtable_ctx *ctx, hashtable_foreach_fn fn, void *arg, size_t nthreads);
+
+// delete every entry for which keep returns false.
+// return true if success, otherwise return false
+bool hashtable_filter(hashtable_ctx *ctx, hashtable_filter_fn keep, void *arg, size_t nthreads);
+
+// copy every entry of src into dst, which is first expanded to hold both.
+// for a key in both tables
+// conflict picks the value, src wins when it is NULL. return true if
+// success, otherwise return false, in which case dst may have taken part
+// of src
+bool hashtable_merge(hashtable_ctx *dst, hashtable_ctx *src, hashtable_merge_fn conflict, void *arg,
+                     size_t nthreads);
+
 // return true if success, otherwise return false
 bool hashtable_expand(hashtable_ctx *ctx, size_t size);
 
+// when enabled, an expansion triggered by hashtable_set builds the new
+// bucket array on a background thread while the table keeps serving from
+// the old one, logging the writes made meanwhile. the first write after the
+// thread is done swaps the arrays, and every write after that replays a few
+// entries of the log until it is empty. gets only read the log and never
+// swap, so they still do not write to the table. the old array is freed on
+// another background thread. disabling waits for all of it.
+// return true if success, otherwise return false
+bool hashtable_async_expand(hashtable_ctx *ctx, bool enable);
+
+// when enabled, the table keeps a blocked Bloom filter of its keys so that
+// most gets of missing keys cost a single cache line. The filter is rebuilt
+// by every expansion and after enough deletes. a fork shares the filter
+// until either side rebuilds it, the keys each adds meanwhile showing up
+// as false positives on the other side.
+// return true if success, otherwise return false
+bool hashtable_bloom_filter(hashtable_ctx *ctx, bool enable);
+
+// return false if the filter is not enabled
+bool hashtable_bloom_stats(hashtable_ctx *ctx, hashtable_bloom_statistics *stats);
+
+// Frozen table: an immutable copy of a table built on a minimal perfect
+// hash, with one slot per key and a single key comparison per lookup.
+// Values are stored as pointer sized integers, so a saved table is only
+// meaningful to readers for which the values mean the same thing.
+
+typedef struct __hashtable_frozen hashtable_frozen;
+
+// return the frozen copy of ctx, or NULL on failure
+hashtable_frozen *hashtable_freeze(hashtable_ctx *ctx);
+
+void hashtable_frozen_destroy(hashtable_frozen *frozen);
+
+// return the value if success, otherwise return NULL
+void *hashtable_frozen_get(const hashtable_frozen *frozen, const char *key);
+
+size_t hashtable_frozen_used(const hashtable_frozen *frozen);
+
+// return true if success, otherwise return false
+bool hashtable_frozen_save(const hashtable_frozen *frozen, const char *path);
+
+// map a file written by hashtable_frozen_save, return NULL on failure
+hashtable_frozen *hashtable_frozen_load(const char *path);
+
+// copy the statistics of the table into stats, walking the buckets to
+// compute the chain length distribution.
+// return false if the library was built without --enable-stats
+bool hashtable_stats(hashtable_ctx *ctx, hashtable_statistics *stats);
+
+// Sharded table: keys are partitioned by the high bits of their hash into
+// independent hashtable_ctx shards.
+//
+// Used directly, the shard functions behave like the plain table functions.
+// After hashtable_shard_start every shard is owned by one thread, which
+// rebuilds the shard from its own cpu (so the memory is first touched on
+// that cpu's NUMA node) and then serves operations that other threads
+// submit in batches through single producer/single consumer queues. An
+// owner with nothing to do, or a producer waiting for its ops, polls for a
+// short while and then sleeps until it is woken.
+
+#define HASHTABLE_SHARD_SET 0
+#define HASHTABLE_SHARD_GET 1
+#define HASHTABLE_SHARD_DELETE 2
+
+typedef struct {
+    int type;           // HASHTABLE_SHARD_SET, HASHTABLE_SHARD_GET or HASHTABLE_SHARD_DELETE
+    const char *key;
+    void *value;        // the value to set, or the value found by a get
+    bool success;       // result of the operation
+    int done;
+} hashtable_shard_op;
+
+typedef struct __hashtable_shard_owner hashtable_shard_owner;
+
+typedef struct {
+    size_t count;
+    int shift;
+    hashtable_ctx **shards;
+
+    // shared-nothing mode, see hashtable_shard_start
+    size_t producers;
+    hashtable_shard_owner *owners;
+} hashtable_shard_ctx;
+
+// count is rounded up to a power of two, size is the initial size of each shard
+hashtable_shard_ctx *hashtable_shard_new(size_t count, size_t size);
+
+void hashtable_shard_destroy(hashtable_shard_ctx *ctx);
+
+// the direct functions must not be called between hashtable_shard_start and hashtable_shard_stop
+bool hashtable_shard_set(hashtable_shard_ctx *ctx, const char *key, void *value);
+
+void *hashtable_shard_get(hashtable_shard_ctx *ctx, const char *key);
+
+bool hashtable_shard_delete(hashtable_shard_ctx *ctx, const char *key);
+
+size_t hashtable_shard_used(hashtable_shard_ctx *ctx);
+
+// start one owner thread per shard, pinned to cpus[i] when cpus is not NULL.
+// producers is the number of threads that will call hashtable_shard_submit,
+// each with its own producer id in [0, producers).
+// return true if success, otherwise return false
+bool hashtable_shard_start(hashtable_shard_ctx *ctx, size_t producers, const int *cpus);
+
+// stop and join the owner threads, the shards can be used directly again
+void hashtable_shard_stop(hashtable_shard_ctx *ctx);
+
+// queue ops to the owners of their shards and wait until all are done.
+// return true if success, otherwise return false
+bool hashtable_shard_submit(hashtable_shard_ctx *ctx, size_t producer, hashtable_shard_op *ops, size_t count);
+
 #endif
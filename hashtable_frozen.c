@@ -0,0 +1,559 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include "hashtable_private.h"
+#include "murmur2.c"
+
+// A frozen table is a minimal perfect hash in the style of PTHash: keys are
+// split into small buckets, and every bucket stores a pilot value chosen so
+// that its keys land on distinct free positions of a range slightly larger
+// than the number of keys. The range leaves the last buckets enough free
+// positions to be placed quickly. Keys placed past the last slot are remapped
+// to the slots left free below it, so that the array still has exactly one
+// slot per key. A lookup hashes the key, reads one pilot, at most one remapped
+// position, and compares one key.
+//
+// The whole structure is one block of memory, written as is by
+// hashtable_frozen_save and mapped as is by hashtable_frozen_load. It is
+// stored in native byte order.
+
+#define HASHTABLE_FROZEN_MAGIC "HTFROZEN"
+#define HASHTABLE_FROZEN_VERSION 2
+// average keys per bucket
+#define HASHTABLE_FROZEN_BUCKET_KEYS 4
+// keys per position of the range the pilots choose from
+#define HASHTABLE_FROZEN_LOAD 0.98
+// pilots tried for a bucket before starting over with another seed
+#define HASHTABLE_FROZEN_MAX_PILOT (1 << 24)
+#define HASHTABLE_FROZEN_MAX_SEEDS 16
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t seed;
+    uint64_t count;
+    // buckets [0, denseBuckets) receive 60% of the keys
+    uint64_t buckets;
+    uint64_t denseBuckets;
+    // positions the pilots choose from, at least count
+    uint64_t range;
+    uint64_t pilotsOffset;
+    // range - count slot indexes, one for each position past the last slot
+    uint64_t remapOffset;
+    uint64_t slotsOffset;
+    uint64_t keysOffset;
+    uint64_t size;
+} hashtable_frozen_header;
+
+// keys up to this length are stored in their slot, so that a lookup reads a
+// single slot; longer keys are stored in the key blob
+#define HASHTABLE_FROZEN_INLINE_KEY 16
+
+typedef struct {
+    uint64_t value;
+    uint32_t keyLen;
+    // high half of the key hash, lets most misses skip the key comparison
+    uint32_t fingerprint;
+    union {
+        char key[HASHTABLE_FROZEN_INLINE_KEY];
+        uint64_t keyOffset;
+    };
+} hashtable_frozen_slot;
+
+struct __hashtable_frozen {
+    const hashtable_frozen_header *header;
+    const uint32_t *pilots;
+    const uint64_t *remap;
+    const hashtable_frozen_slot *slots;
+    const char *keys;
+    size_t mapped;
+};
+
+typedef struct {
+    uint64_t hash;
+    uint64_t bucket;
+    hashtable_entry *entry;
+} hashtable_frozen_key;
+
+// MurmurHash64A, from the same file as MurmurHash2. two 32 bit MurmurHash2
+// with related seeds are correlated and collide in full for thousands of
+// 17M short keys, which no pilot can tell apart
+static uint64_t hashtable_frozen_hash(const char *key, size_t len, uint32_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *data = (const unsigned char *)key;
+    uint64_t h = seed ^ (len * m);
+
+    while (len >= 8) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+
+        data += 8;
+        len -= 8;
+    }
+
+    switch (len) {
+    case 7:
+        h ^= (uint64_t)data[6] << 48;
+        /* FALLTHROUGH */
+    case 6:
+        h ^= (uint64_t)data[5] << 40;
+        /* FALLTHROUGH */
+    case 5:
+        h ^= (uint64_t)data[4] << 32;
+        /* FALLTHROUGH */
+    case 4:
+        h ^= (uint64_t)data[3] << 24;
+        /* FALLTHROUGH */
+    case 3:
+        h ^= (uint64_t)data[2] << 16;
+        /* FALLTHROUGH */
+    case 2:
+        h ^= (uint64_t)data[1] << 8;
+        /* FALLTHROUGH */
+    case 1:
+        h ^= data[0];
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
+static uint64_t hashtable_frozen_mix(uint64_t x) {
+    // murmur3 fmix64
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t hashtable_frozen_bucket(const hashtable_frozen_header *header, uint64_t hash) {
+    uint32_t high = hash >> 32;
+
+    // skew the buckets so that the large ones are placed first, see PTHash
+    if (high < (uint32_t)(0.6 * UINT32_MAX)) {
+        return high % header->denseBuckets;
+    }
+
+    return header->denseBuckets + high % (header->buckets - header->denseBuckets);
+}
+
+static uint64_t hashtable_frozen_position(const hashtable_frozen_header *header, uint64_t hash, uint32_t pilot) {
+    return (hash ^ hashtable_frozen_mix(pilot ^ ((uint64_t)header->seed << 32))) % header->range;
+}
+
+static void hashtable_frozen_bind(hashtable_frozen *frozen, const hashtable_frozen_header *header) {
+    frozen->header = header;
+    frozen->pilots = (const uint32_t *)((const char *)header + header->pilotsOffset);
+    frozen->remap = (const uint64_t *)((const char *)header + header->remapOffset);
+    frozen->slots = (const hashtable_frozen_slot *)((const char *)header + header->slotsOffset);
+    frozen->keys = (const char *)header + header->keysOffset;
+}
+
+// find a pilot for every bucket and remap the positions past the last slot,
+// return false to retry with another seed
+static bool hashtable_frozen_search(hashtable_frozen_header *header, uint32_t *pilots, uint64_t *remap,
+                                    hashtable_frozen_key *keys, uint64_t *positions) {
+    uint64_t count = header->count;
+    uint64_t range = header->range;
+    uint64_t i;
+    uint64_t j;
+    uint64_t k;
+
+    // [start, end) of every bucket in keys, ordered by size, largest first
+    uint64_t *starts = calloc(header->buckets + 1, sizeof(uint64_t));
+    uint64_t *order = malloc(header->buckets * sizeof(uint64_t));
+    uint64_t *sizes = calloc(count + 2, sizeof(uint64_t));
+    uint8_t *taken = calloc((range + 7) / 8, 1);
+    hashtable_frozen_key *sorted = malloc((count + 1) * sizeof(hashtable_frozen_key));
+    bool success = false;
+
+    if (NULL == starts || NULL == order || NULL == sizes || NULL == taken || NULL == sorted) {
+        goto done;
+    }
+
+    for (i = 0; i < count; i++) {
+        keys[i].bucket = hashtable_frozen_bucket(header, keys[i].hash);
+        starts[keys[i].bucket + 1]++;
+    }
+    for (i = 0; i < header->buckets; i++) {
+        starts[i + 1] += starts[i];
+    }
+
+    // counting sort of the keys by bucket, order is free until the buckets
+    // are sorted below
+    memcpy(order, starts, header->buckets * sizeof(uint64_t));
+    for (i = 0; i < count; i++) {
+        sorted[order[keys[i].bucket]++] = keys[i];
+    }
+    memcpy(keys, sorted, count * sizeof(hashtable_frozen_key));
+
+    // counting sort of the buckets by descending size
+    uint64_t largest = 0;
+    for (i = 0; i < header->buckets; i++) {
+        uint64_t size = starts[i + 1] - starts[i];
+        sizes[size]++;
+        if (size > largest) {
+            largest = size;
+        }
+    }
+    uint64_t offset = 0;
+    for (k = largest + 1; k-- > 0;) {
+        uint64_t n = sizes[k];
+        sizes[k] = offset;
+        offset += n;
+    }
+    for (i = 0; i < header->buckets; i++) {
+        order[sizes[starts[i + 1] - starts[i]]++] = i;
+    }
+
+    for (i = 0; i < header->buckets; i++) {
+        uint64_t bucket = order[i];
+        uint64_t start = starts[bucket];
+        uint64_t end = starts[bucket + 1];
+        uint32_t pilot;
+
+        if (start == end) {
+            pilots[bucket] = 0;
+            continue;
+        }
+
+        for (pilot = 0; pilot < HASHTABLE_FROZEN_MAX_PILOT; pilot++) {
+            for (j = start; j < end; j++) {
+                uint64_t position = hashtable_frozen_position(header, keys[j].hash, pilot);
+                if (taken[position / 8] & (1 << (position % 8))) {
+                    break;
+                }
+                for (k = start; k < j; k++) {
+                    if (positions[k] == position) {
+                        break;
+                    }
+                }
+                if (k < j) {
+                    break;
+                }
+                positions[j] = position;
+            }
+            if (j == end) {
+                break;
+            }
+        }
+
+        if (HASHTABLE_FROZEN_MAX_PILOT == pilot) {
+            goto done;
+        }
+
+        pilots[bucket] = pilot;
+        for (j = start; j < end; j++) {
+            taken[positions[j] / 8] |= 1 << (positions[j] % 8);
+        }
+    }
+
+    // as many positions past the last slot are taken as slots below it are
+    // free, pair them up in order
+    k = 0;
+    for (i = count; i < range; i++) {
+        if (taken[i / 8] & (1 << (i % 8))) {
+            while (taken[k / 8] & (1 << (k % 8))) {
+                k++;
+            }
+            remap[i - count] = k++;
+        } else {
+            remap[i - count] = 0;
+        }
+    }
+    for (j = 0; j < count; j++) {
+        if (positions[j] >= count) {
+            positions[j] = remap[positions[j] - count];
+        }
+    }
+    success = true;
+
+done:
+    free(starts);
+    free(order);
+    free(sizes);
+    free(taken);
+    free(sorted);
+    return success;
+}
+
+hashtable_frozen *hashtable_freeze(hashtable_ctx *ctx) {
+    // let a background expansion finish so that the buckets are complete
+    hashtable_async_wait(ctx);
+
+    uint64_t count = ctx->used;
+    // at least one dense and one sparse bucket
+    uint64_t buckets = count / HASHTABLE_FROZEN_BUCKET_KEYS + 2;
+    uint64_t range = count / HASHTABLE_FROZEN_LOAD;
+    uint64_t keyBytes = 0;
+    uint64_t i;
+    size_t n = 0;
+    hashtable_entry *current;
+
+    hashtable_frozen *frozen = calloc(1, sizeof(hashtable_frozen));
+    hashtable_frozen_key *keys = malloc((count + 1) * sizeof(hashtable_frozen_key));
+    uint64_t *positions = malloc((count + 1) * sizeof(uint64_t));
+    hashtable_frozen_header *header = NULL;
+
+    if (NULL == frozen || NULL == keys || NULL == positions) {
+        goto fail;
+    }
+
+    for (i = 0; i < ctx->size; i++) {
+        for (current = *hashtable_bucket(ctx, i); current; current = current->next) {
+            keys[n++].entry = current;
+            size_t keyLen = strlen(current->key);
+            if (keyLen > HASHTABLE_FROZEN_INLINE_KEY) {
+                keyBytes += keyLen;
+            }
+        }
+    }
+
+    if (range < count) {
+        range = count;
+    }
+
+    uint64_t pilotsOffset = sizeof(hashtable_frozen_header);
+    uint64_t remapOffset = (pilotsOffset + buckets * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+    // two slots per cache line
+    uint64_t slotsOffset = (remapOffset + (range - count) * sizeof(uint64_t) + 63) & ~(uint64_t)63;
+    uint64_t keysOffset = slotsOffset + count * sizeof(hashtable_frozen_slot);
+    uint64_t size = keysOffset + keyBytes;
+
+    if (0 != posix_memalign((void **)&header, 64, size)) {
+        header = NULL;
+        goto fail;
+    }
+    memset(header, 0, size);
+    memcpy(header->magic, HASHTABLE_FROZEN_MAGIC, sizeof(header->magic));
+    header->version = HASHTABLE_FROZEN_VERSION;
+    header->count = count;
+    header->buckets = buckets;
+    header->denseBuckets = buckets * 3 / 10 + 1;
+    header->range = range;
+    header->pilotsOffset = pilotsOffset;
+    header->remapOffset = remapOffset;
+    header->slotsOffset = slotsOffset;
+    header->keysOffset = keysOffset;
+    header->size = size;
+    hashtable_frozen_bind(frozen, header);
+
+    uint32_t *pilots = (uint32_t *)((char *)header + pilotsOffset);
+    uint64_t *remap = (uint64_t *)((char *)header + remapOffset);
+    hashtable_frozen_slot *slots = (hashtable_frozen_slot *)((char *)header + slotsOffset);
+    char *blob = (char *)header + keysOffset;
+    uint32_t attempt;
+
+    for (attempt = 0; attempt < HASHTABLE_FROZEN_MAX_SEEDS; attempt++) {
+        header->seed = MURMURHASH_SEED + attempt * 0x9e3779b9;
+        for (i = 0; i < count; i++) {
+            const char *key = keys[i].entry->key;
+            keys[i].hash = hashtable_frozen_hash(key, strlen(key), header->seed);
+        }
+        if (hashtable_frozen_search(header, pilots, remap, keys, positions)) {
+            break;
+        }
+    }
+    if (HASHTABLE_FROZEN_MAX_SEEDS == attempt) {
+        goto fail;
+    }
+
+    uint64_t keyOffset = 0;
+    for (i = 0; i < count; i++) {
+        hashtable_frozen_slot *slot = &slots[positions[i]];
+        size_t keyLen = strlen(keys[i].entry->key);
+
+        if (keyLen > HASHTABLE_FROZEN_INLINE_KEY) {
+            memcpy(blob + keyOffset, keys[i].entry->key, keyLen);
+            slot->keyOffset = keyOffset;
+            keyOffset += keyLen;
+        } else {
+            memcpy(slot->key, keys[i].entry->key, keyLen);
+        }
+        slot->keyLen = keyLen;
+        slot->fingerprint = keys[i].hash >> 32;
+        slot->value = (uintptr_t)keys[i].entry->value;
+    }
+
+    free(keys);
+    free(positions);
+    return frozen;
+
+fail:
+    free(header);
+    free(frozen);
+    free(keys);
+    free(positions);
+    return NULL;
+}
+
+void hashtable_frozen_destroy(hashtable_frozen *frozen) {
+#ifdef HAVE_MMAP
+    if (frozen->mapped) {
+        munmap((void *)frozen->header, frozen->mapped);
+        free(frozen);
+        return;
+    }
+#endif
+    free((void *)frozen->header);
+    free(frozen);
+}
+
+void *hashtable_frozen_get(const hashtable_frozen *frozen, const char *key) {
+    const hashtable_frozen_header *header = frozen->header;
+
+    if (0 == header->count) {
+        return NULL;
+    }
+
+    size_t keyLen = strlen(key);
+    uint64_t hash = hashtable_frozen_hash(key, keyLen, header->seed);
+    uint32_t pilot = frozen->pilots[hashtable_frozen_bucket(header, hash)];
+    uint64_t position = hashtable_frozen_position(header, hash, pilot);
+    if (position >= header->count) {
+        position = frozen->remap[position - header->count];
+    }
+    const hashtable_frozen_slot *slot = &frozen->slots[position];
+
+    if (slot->fingerprint != (uint32_t)(hash >> 32) || slot->keyLen != keyLen) {
+        return NULL;
+    }
+    const char *slotKey = slot->key;
+    if (keyLen > HASHTABLE_FROZEN_INLINE_KEY) {
+        // a loaded file may be corrupted, keep the key within the blob
+        uint64_t blob = header->size - header->keysOffset;
+        if (slot->keyOffset > blob || keyLen > blob - slot->keyOffset) {
+            return NULL;
+        }
+        slotKey = frozen->keys + slot->keyOffset;
+    }
+    if (0 != memcmp(slotKey, key, keyLen)) {
+        return NULL;
+    }
+
+    return (void *)(uintptr_t)slot->value;
+}
+
+size_t hashtable_frozen_used(const hashtable_frozen *frozen) {
+    return frozen->header->count;
+}
+
+bool hashtable_frozen_save(const hashtable_frozen *frozen, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (NULL == fp) {
+        return false;
+    }
+
+    bool success = 1 == fwrite(frozen->header, frozen->header->size, 1, fp);
+    if (0 != fclose(fp)) {
+        success = false;
+    }
+
+    return success;
+}
+
+static bool hashtable_frozen_valid(const hashtable_frozen_header *header, uint64_t size) {
+    if (size < sizeof(hashtable_frozen_header) || header->size != size ||
+        0 != memcmp(header->magic, HASHTABLE_FROZEN_MAGIC, sizeof(header->magic)) ||
+        HASHTABLE_FROZEN_VERSION != header->version) {
+        return false;
+    }
+
+    // the sections follow each other in order, sizes are compared by
+    // division so that no product or sum can overflow. the key of each slot
+    // is checked against the blob by hashtable_frozen_get
+    if (!(header->denseBuckets > 0 && header->denseBuckets < header->buckets && header->range >= header->count &&
+          header->pilotsOffset >= sizeof(hashtable_frozen_header) && header->pilotsOffset % sizeof(uint32_t) == 0 &&
+          header->remapOffset >= header->pilotsOffset && header->remapOffset % sizeof(uint64_t) == 0 &&
+          header->buckets <= (header->remapOffset - header->pilotsOffset) / sizeof(uint32_t) &&
+          header->slotsOffset >= header->remapOffset && header->slotsOffset % 64 == 0 &&
+          header->range - header->count <= (header->slotsOffset - header->remapOffset) / sizeof(uint64_t) &&
+          header->keysOffset >= header->slotsOffset &&
+          header->count <= (header->keysOffset - header->slotsOffset) / sizeof(hashtable_frozen_slot) &&
+          header->keysOffset <= size)) {
+        return false;
+    }
+
+    // a few percent of the slots, every remapped position must be a slot
+    const uint64_t *remap = (const uint64_t *)((const char *)header + header->remapOffset);
+    uint64_t i;
+    for (i = 0; i < header->range - header->count; i++) {
+        if (remap[i] >= header->count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+hashtable_frozen *hashtable_frozen_load(const char *path) {
+    struct stat st;
+    void *data;
+
+    hashtable_frozen *frozen = calloc(1, sizeof(hashtable_frozen));
+    if (NULL == frozen) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        free(frozen);
+        return NULL;
+    }
+    if (0 != fstat(fd, &st) || st.st_size < (off_t)sizeof(hashtable_frozen_header)) {
+        close(fd);
+        free(frozen);
+        return NULL;
+    }
+
+#ifdef HAVE_MMAP
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == data) {
+        free(frozen);
+        return NULL;
+    }
+    frozen->mapped = st.st_size;
+#else
+    data = malloc(st.st_size);
+    if (NULL == data || st.st_size != read(fd, data, st.st_size)) {
+        close(fd);
+        free(data);
+        free(frozen);
+        return NULL;
+    }
+    close(fd);
+#endif
+
+    if (!hashtable_frozen_valid(data, st.st_size)) {
+        hashtable_frozen_bind(frozen, data);
+        hashtable_frozen_destroy(frozen);
+        return NULL;
+    }
+    hashtable_frozen_bind(frozen, data);
+
+    return frozen;
+}
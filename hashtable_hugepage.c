@@ -0,0 +1,278 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include "hashtable.h"
+
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+#define HASHTABLE_HUGEPAGE_MMAP 1
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+// transparent huge pages are this size whatever page size was asked for
+#define HASHTABLE_HUGEPAGE_THP ((size_t)2 << 20)
+// small blocks are rounded up to a multiple of this
+#define HASHTABLE_HUGEPAGE_CLASS 16
+#define HASHTABLE_HUGEPAGE_CLASSES (HASHTABLE_HUGEPAGE_SMALL / HASHTABLE_HUGEPAGE_CLASS)
+
+// the head of every chunk of small blocks
+typedef struct __hashtable_hugepage_chunk {
+    struct __hashtable_hugepage_chunk *next;
+    size_t pad;
+} hashtable_hugepage_chunk;
+
+typedef struct {
+    // first, so that the allocator given out converts back to the whole
+    hashtable_allocator allocator;
+    size_t pageSize;
+    int hugetlbFlags;
+    pthread_mutex_t lock;
+
+    // freed small blocks by size class, linked through their first word
+    void *free[HASHTABLE_HUGEPAGE_CLASSES];
+    hashtable_hugepage_chunk *chunks;
+    // unused part of the newest chunk
+    char *next;
+    char *end;
+
+    hashtable_hugepage_statistics stats;
+} hashtable_hugepage;
+
+static size_t hashtable_hugepage_length(hashtable_hugepage *h, size_t size) {
+    return (size + h->pageSize - 1) & ~(h->pageSize - 1);
+}
+
+static size_t hashtable_hugepage_class(size_t size) {
+    return size ? (size - 1) / HASHTABLE_HUGEPAGE_CLASS : 0;
+}
+
+// map length bytes, a multiple of the page size. counts the mapping in the
+// statistics, so the caller must hold the lock
+static void *hashtable_hugepage_map(hashtable_hugepage *h, size_t length) {
+#ifdef HASHTABLE_HUGEPAGE_MMAP
+    char *ptr;
+
+#ifdef MAP_HUGETLB
+    // fails right away when the pool has no free page of that size
+    ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | h->hugetlbFlags, -1, 0);
+    if (MAP_FAILED != ptr) {
+        h->stats.hugetlb_mappings++;
+        h->stats.mapped_bytes += length;
+        return ptr;
+    }
+#endif
+
+    // map a transparent huge page more, so that the block can start on a
+    // huge page boundary, and give the slack back
+    char *raw = mmap(NULL, length + HASHTABLE_HUGEPAGE_THP, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == raw) {
+        return NULL;
+    }
+    ptr = (char *)(((uintptr_t)raw + HASHTABLE_HUGEPAGE_THP - 1) & ~(uintptr_t)(HASHTABLE_HUGEPAGE_THP - 1));
+    if (ptr != raw) {
+        munmap(raw, ptr - raw);
+    }
+    if (ptr != raw + HASHTABLE_HUGEPAGE_THP) {
+        munmap(ptr + length, raw + HASHTABLE_HUGEPAGE_THP - ptr);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, length, MADV_HUGEPAGE);
+#endif
+    h->stats.madvise_mappings++;
+    h->stats.mapped_bytes += length;
+    return ptr;
+#else
+    return NULL;
+#endif
+}
+
+static void hashtable_hugepage_unmap(hashtable_hugepage *h, void *ptr, size_t length) {
+#ifdef HASHTABLE_HUGEPAGE_MMAP
+    munmap(ptr, length);
+    pthread_mutex_lock(&h->lock);
+    h->stats.mapped_bytes -= length;
+    pthread_mutex_unlock(&h->lock);
+#endif
+}
+
+static void *hashtable_hugepage_malloc(void *ctx, size_t size) {
+    hashtable_hugepage *h = ctx;
+    void *block;
+
+    if (size > HASHTABLE_HUGEPAGE_SMALL && size < h->pageSize) {
+        return malloc(size);
+    }
+
+    pthread_mutex_lock(&h->lock);
+    if (size >= h->pageSize) {
+        block = hashtable_hugepage_map(h, hashtable_hugepage_length(h, size));
+        pthread_mutex_unlock(&h->lock);
+        return block;
+    }
+
+    size_t cls = hashtable_hugepage_class(size);
+    size_t blockSize = (cls + 1) * HASHTABLE_HUGEPAGE_CLASS;
+
+    block = h->free[cls];
+    if (block) {
+        h->free[cls] = *(void **)block;
+    } else {
+        // the rest of a full chunk is left unused
+        if ((size_t)(h->end - h->next) < blockSize) {
+            hashtable_hugepage_chunk *chunk = hashtable_hugepage_map(h, h->pageSize);
+            if (NULL == chunk) {
+                pthread_mutex_unlock(&h->lock);
+                return NULL;
+            }
+            chunk->next = h->chunks;
+            h->chunks = chunk;
+            h->next = (char *)(chunk + 1);
+            h->end = (char *)chunk + h->pageSize;
+            h->stats.chunk_bytes += h->pageSize;
+        }
+        block = h->next;
+        h->next += blockSize;
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    return block;
+}
+
+static void *hashtable_hugepage_calloc(void *ctx, size_t size) {
+    hashtable_hugepage *h = ctx;
+
+    if (size > HASHTABLE_HUGEPAGE_SMALL && size < h->pageSize) {
+        return calloc(1, size);
+    }
+
+    void *block = hashtable_hugepage_malloc(ctx, size);
+    // blocks mapped on their own are fresh zero pages, small ones may be recycled
+    if (block && size < h->pageSize) {
+        memset(block, 0, size);
+    }
+
+    return block;
+}
+
+static void hashtable_hugepage_free(void *ctx, void *ptr, size_t size) {
+    hashtable_hugepage *h = ctx;
+
+    if (size >= h->pageSize) {
+        hashtable_hugepage_unmap(h, ptr, hashtable_hugepage_length(h, size));
+        return;
+    }
+    if (size > HASHTABLE_HUGEPAGE_SMALL) {
+        free(ptr);
+        return;
+    }
+
+    size_t cls = hashtable_hugepage_class(size);
+
+    pthread_mutex_lock(&h->lock);
+    *(void **)ptr = h->free[cls];
+    h->free[cls] = ptr;
+    pthread_mutex_unlock(&h->lock);
+}
+
+static void *hashtable_hugepage_realloc(void *ctx, void *ptr, size_t oldSize, size_t size) {
+    hashtable_hugepage *h = ctx;
+
+    if (oldSize >= h->pageSize && size >= h->pageSize) {
+        size_t oldLength = hashtable_hugepage_length(h, oldSize);
+        size_t length = hashtable_hugepage_length(h, size);
+        if (oldLength == length) {
+            return ptr;
+        }
+#if defined(HASHTABLE_HUGEPAGE_MMAP) && defined(HAVE_MREMAP) && defined(MREMAP_MAYMOVE)
+        // moves the pages instead of copying them, huge pages need a recent kernel
+        void *moved = mremap(ptr, oldLength, length, MREMAP_MAYMOVE);
+        if (MAP_FAILED != moved) {
+            pthread_mutex_lock(&h->lock);
+            h->stats.mapped_bytes += length - oldLength;
+            pthread_mutex_unlock(&h->lock);
+            return moved;
+        }
+#endif
+    } else if (oldSize > HASHTABLE_HUGEPAGE_SMALL && oldSize < h->pageSize &&
+               size > HASHTABLE_HUGEPAGE_SMALL && size < h->pageSize) {
+        return realloc(ptr, size);
+    } else if (oldSize <= HASHTABLE_HUGEPAGE_SMALL && size <= HASHTABLE_HUGEPAGE_SMALL &&
+               hashtable_hugepage_class(oldSize) == hashtable_hugepage_class(size)) {
+        return ptr;
+    }
+
+    void *block = hashtable_hugepage_malloc(h, size);
+    if (NULL == block) {
+        return NULL;
+    }
+    memcpy(block, ptr, oldSize < size ? oldSize : size);
+    hashtable_hugepage_free(h, ptr, oldSize);
+
+    return block;
+}
+
+hashtable_allocator *hashtable_hugepage_new(size_t page_size) {
+#ifdef HASHTABLE_HUGEPAGE_MMAP
+    int shift = 0;
+
+    // a power of two no smaller than a transparent huge page
+    if (page_size < HASHTABLE_HUGEPAGE_THP || 0 != (page_size & (page_size - 1))) {
+        return NULL;
+    }
+    while (((size_t)1 << shift) < page_size) {
+        shift++;
+    }
+
+    hashtable_hugepage *h = calloc(1, sizeof(hashtable_hugepage));
+    if (NULL == h) {
+        return NULL;
+    }
+    if (0 != pthread_mutex_init(&h->lock, NULL)) {
+        free(h);
+        return NULL;
+    }
+
+    h->pageSize = page_size;
+    h->hugetlbFlags = shift << MAP_HUGE_SHIFT;
+    h->allocator.malloc = hashtable_hugepage_malloc;
+    h->allocator.calloc = hashtable_hugepage_calloc;
+    h->allocator.realloc = hashtable_hugepage_realloc;
+    h->allocator.free = hashtable_hugepage_free;
+    h->allocator.ctx = h;
+
+    return &h->allocator;
+#else
+    return NULL;
+#endif
+}
+
+void hashtable_hugepage_destroy(hashtable_allocator *allocator) {
+    hashtable_hugepage *h = allocator->ctx;
+    hashtable_hugepage_chunk *chunk;
+
+    while ((chunk = h->chunks)) {
+        h->chunks = chunk->next;
+        hashtable_hugepage_unmap(h, chunk, h->pageSize);
+    }
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+void hashtable_hugepage_stats(const hashtable_allocator *allocator, hashtable_hugepage_statistics *stats) {
+    hashtable_hugepage *h = allocator->ctx;
+
+    pthread_mutex_lock(&h->lock);
+    *stats = h->stats;
+    pthread_mutex_unlock(&h->lock);
+}
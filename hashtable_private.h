@@ -0,0 +1,42 @@
+#ifndef __HASHTABLE_PRIVATE_H
+#define __HASHTABLE_PRIVATE_H
+
+#include "hashtable.h"
+
+// Shared by the source files of the library, not part of its API.
+
+// A forked table shares ctx->table with its forks, counted by
+// ctx->table_refs. The pages of HASHTABLE_PAGE_BUCKETS buckets either side
+// writes to afterwards are copied into its overlay, which supersedes
+// ctx->table for them. An overlay counts the tables and a page the overlays
+// holding it, so that the forks of a fork share them as well.
+
+#define HASHTABLE_PAGE_BITS 9
+#define HASHTABLE_PAGE_BUCKETS ((size_t)1 << HASHTABLE_PAGE_BITS)
+
+typedef struct {
+    size_t refs;
+    hashtable_entry *buckets[HASHTABLE_PAGE_BUCKETS];
+} hashtable_page;
+
+struct __hashtable_overlay {
+    size_t refs;
+    // NULL where ctx->table is still current
+    hashtable_page *pages[0];
+};
+
+// the bucket at index, only to be written by the single owner of the table
+static inline hashtable_entry **hashtable_bucket(const hashtable_ctx *ctx, size_t index) {
+    hashtable_page *page;
+
+    if (ctx->overlay && (page = ctx->overlay->pages[index >> HASHTABLE_PAGE_BITS])) {
+        return &page->buckets[index & (HASHTABLE_PAGE_BUCKETS - 1)];
+    }
+
+    return &ctx->table[index];
+}
+
+// wait for a running async expansion, swap in its result and replay its log
+void hashtable_async_wait(hashtable_ctx *ctx);
+
+#endif
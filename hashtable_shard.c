@@ -0,0 +1,475 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "hashtable_private.h"
+#include "murmur2.c"
+
+// slots of each producer -> owner queue, must be a power of two
+#define HASHTABLE_SHARD_RING 1024
+#define HASHTABLE_SHARD_CACHELINE 64
+// a thread that finds nothing to do polls this many times, then yields this
+// many times, then parks on a condition variable until it is woken
+#define HASHTABLE_SHARD_SPINS 64
+#define HASHTABLE_SHARD_YIELDS 64
+
+typedef struct {
+    // written by the owner
+    size_t head __attribute__((aligned(HASHTABLE_SHARD_CACHELINE)));
+    // written by the producer
+    size_t tail __attribute__((aligned(HASHTABLE_SHARD_CACHELINE)));
+    hashtable_shard_op *slots[HASHTABLE_SHARD_RING] __attribute__((aligned(HASHTABLE_SHARD_CACHELINE)));
+} hashtable_shard_ring;
+
+struct __hashtable_shard_owner {
+    hashtable_shard_ctx *ctx;
+    size_t index;
+    int cpu;
+    bool ready;
+    bool failed;
+    bool stop;
+    pthread_t thread;
+    // one queue per producer
+    hashtable_shard_ring *rings;
+    // the owner parks on wake once its queues stay empty, producers park on
+    // done while they wait for its ops or for room in a full queue
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    bool sleeping;
+    size_t waiters;
+};
+
+static size_t hashtable_shard_index(hashtable_shard_ctx *ctx, const char *key) {
+    return (uint64_t)MurmurHash2(key, strlen(key)) >> ctx->shift;
+}
+
+hashtable_shard_ctx *hashtable_shard_new(size_t count, size_t size) {
+    hashtable_shard_ctx *ctx = calloc(1, sizeof(hashtable_shard_ctx));
+    if (NULL == ctx) {
+        return NULL;
+    }
+
+    ctx->count = 1;
+    ctx->shift = 32;
+    while (ctx->count < count && ctx->shift > 0) {
+        ctx->count <<= 1;
+        ctx->shift--;
+    }
+
+    ctx->shards = calloc(ctx->count, sizeof(hashtable_ctx *));
+    if (NULL == ctx->shards) {
+        free(ctx);
+        return NULL;
+    }
+
+    size_t i;
+    for (i = 0; i < ctx->count; i++) {
+        ctx->shards[i] = hashtable_new(size);
+        if (NULL == ctx->shards[i]) {
+            hashtable_shard_destroy(ctx);
+            return NULL;
+        }
+    }
+
+    return ctx;
+}
+
+void hashtable_shard_destroy(hashtable_shard_ctx *ctx) {
+    size_t i;
+
+    if (ctx->owners) {
+        hashtable_shard_stop(ctx);
+    }
+
+    for (i = 0; i < ctx->count; i++) {
+        if (ctx->shards[i]) {
+            hashtable_destroy(ctx->shards[i]);
+        }
+    }
+    free(ctx->shards);
+    free(ctx);
+}
+
+bool hashtable_shard_set(hashtable_shard_ctx *ctx, const char *key, void *value) {
+    return hashtable_set(ctx->shards[hashtable_shard_index(ctx, key)], key, value);
+}
+
+void *hashtable_shard_get(hashtable_shard_ctx *ctx, const char *key) {
+    return hashtable_get(ctx->shards[hashtable_shard_index(ctx, key)], key);
+}
+
+bool hashtable_shard_delete(hashtable_shard_ctx *ctx, const char *key) {
+    return hashtable_delete(ctx->shards[hashtable_shard_index(ctx, key)], key);
+}
+
+size_t hashtable_shard_used(hashtable_shard_ctx *ctx) {
+    size_t used = 0;
+    size_t i;
+
+    for (i = 0; i < ctx->count; i++) {
+        used += ctx->shards[i]->used;
+    }
+
+    return used;
+}
+
+static void hashtable_shard_execute(hashtable_ctx *shard, hashtable_shard_op *op) {
+    switch (op->type) {
+    case HASHTABLE_SHARD_SET:
+        op->success = hashtable_set(shard, op->key, op->value);
+        break;
+    case HASHTABLE_SHARD_GET:
+        op->value = hashtable_get(shard, op->key);
+        op->success = NULL != op->value;
+        break;
+    case HASHTABLE_SHARD_DELETE:
+        op->success = hashtable_delete(shard, op->key);
+        break;
+    default:
+        op->success = false;
+    }
+}
+
+// move the entries of a shard into memory allocated by the calling thread,
+// keeping its Bloom filter, async expansion and statistics
+static hashtable_ctx *hashtable_shard_localize(hashtable_ctx *shard) {
+    // the buckets are complete only once a running expansion is done
+    hashtable_async_wait(shard);
+
+    hashtable_ctx *local = hashtable_new_with_allocator(shard->size, &shard->allocator);
+    if (NULL == local) {
+        return NULL;
+    }
+
+    if ((shard->bloom && false == hashtable_bloom_filter(local, true)) ||
+        (shard->async && false == hashtable_async_expand(local, true))) {
+        hashtable_destroy(local);
+        return NULL;
+    }
+
+    size_t i;
+    hashtable_entry *current;
+
+    for (i = 0; i < shard->size; i++) {
+        for (current = *hashtable_bucket(shard, i); current; current = current->next) {
+            if (false == hashtable_set(local, current->key, current->value)) {
+                hashtable_destroy(local);
+                return NULL;
+            }
+        }
+    }
+
+    // the counters of the operations carry over, the memory is the new one's
+    if (shard->stats) {
+        uint64_t bytes = local->stats->bytes_allocated;
+        uint64_t expansions = local->stats->expansions;
+        uint64_t expandNs = local->stats->expand_ns;
+        *local->stats = *shard->stats;
+        local->stats->bytes_allocated = bytes;
+        local->stats->expansions += expansions;
+        local->stats->expand_ns += expandNs;
+    }
+
+    return local;
+}
+
+static bool hashtable_shard_pending(hashtable_shard_owner *owner) {
+    size_t p;
+
+    for (p = 0; p < owner->ctx->producers; p++) {
+        hashtable_shard_ring *ring = &owner->rings[p];
+        if (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// sleep until a producer queues an op or the owner is stopped. sleeping is
+// set before the queues are checked a last time and a producer checks it
+// after queueing, so one of them sees the other
+static void hashtable_shard_park(hashtable_shard_owner *owner) {
+    __atomic_store_n(&owner->sleeping, true, __ATOMIC_SEQ_CST);
+    if (hashtable_shard_pending(owner)) {
+        __atomic_store_n(&owner->sleeping, false, __ATOMIC_RELAXED);
+        return;
+    }
+
+    pthread_mutex_lock(&owner->lock);
+    while (__atomic_load_n(&owner->sleeping, __ATOMIC_RELAXED) && !__atomic_load_n(&owner->stop, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&owner->wake, &owner->lock);
+    }
+    pthread_mutex_unlock(&owner->lock);
+}
+
+// wake the owner if it is parked, after ops were queued to it
+static void hashtable_shard_wake(hashtable_shard_owner *owner) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&owner->sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&owner->lock);
+        __atomic_store_n(&owner->sleeping, false, __ATOMIC_RELAXED);
+        pthread_cond_signal(&owner->wake);
+        pthread_mutex_unlock(&owner->lock);
+    }
+}
+
+// spin, then yield, return false once the caller should park instead
+static bool hashtable_shard_backoff(size_t *polls) {
+    if (++*polls > HASHTABLE_SHARD_SPINS + HASHTABLE_SHARD_YIELDS) {
+        *polls = 0;
+        return false;
+    }
+    if (*polls > HASHTABLE_SHARD_SPINS) {
+        sched_yield();
+    }
+
+    return true;
+}
+
+// sleep until the owner moves the head of a queue on from value
+static void hashtable_shard_sleep(hashtable_shard_owner *owner, const size_t *head, size_t value) {
+    // the owner checks waiters after moving a head, pairs with its fence
+    __atomic_add_fetch(&owner->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&owner->lock);
+    while (__atomic_load_n(head, __ATOMIC_SEQ_CST) == value) {
+        pthread_cond_wait(&owner->done, &owner->lock);
+    }
+    pthread_mutex_unlock(&owner->lock);
+    __atomic_sub_fetch(&owner->waiters, 1, __ATOMIC_RELAXED);
+}
+
+static void *hashtable_shard_owner_run(void *arg) {
+    hashtable_shard_owner *owner = arg;
+    hashtable_shard_ctx *ctx = owner->ctx;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    if (owner->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(owner->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+
+    hashtable_ctx *shard = hashtable_shard_localize(ctx->shards[owner->index]);
+    if (NULL == shard) {
+        __atomic_store_n(&owner->failed, true, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    hashtable_destroy(ctx->shards[owner->index]);
+    ctx->shards[owner->index] = shard;
+    __atomic_store_n(&owner->ready, true, __ATOMIC_RELEASE);
+
+    size_t polls = 0;
+
+    while (!__atomic_load_n(&owner->stop, __ATOMIC_ACQUIRE)) {
+        bool idle = true;
+        size_t p;
+
+        for (p = 0; p < ctx->producers; p++) {
+            hashtable_shard_ring *ring = &owner->rings[p];
+            size_t head = ring->head;
+            size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+            while (head != tail) {
+                hashtable_shard_op *op = ring->slots[head & (HASHTABLE_SHARD_RING - 1)];
+                hashtable_shard_execute(shard, op);
+                __atomic_store_n(&op->done, 1, __ATOMIC_RELEASE);
+                head++;
+                idle = false;
+            }
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        }
+
+        if (!idle) {
+            polls = 0;
+            // pairs with hashtable_shard_sleep
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&owner->waiters, __ATOMIC_RELAXED)) {
+                pthread_mutex_lock(&owner->lock);
+                pthread_cond_broadcast(&owner->done);
+                pthread_mutex_unlock(&owner->lock);
+            }
+        } else if (!hashtable_shard_backoff(&polls)) {
+            hashtable_shard_park(owner);
+        }
+    }
+
+    return NULL;
+}
+
+static void hashtable_shard_owner_stop(hashtable_shard_owner *owner) {
+    pthread_mutex_lock(&owner->lock);
+    __atomic_store_n(&owner->stop, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&owner->wake);
+    pthread_mutex_unlock(&owner->lock);
+}
+
+static void hashtable_shard_owner_free(hashtable_shard_owner *owner) {
+    if (owner->rings) {
+        pthread_cond_destroy(&owner->done);
+        pthread_cond_destroy(&owner->wake);
+        pthread_mutex_destroy(&owner->lock);
+        free(owner->rings);
+    }
+}
+
+bool hashtable_shard_start(hashtable_shard_ctx *ctx, size_t producers, const int *cpus) {
+    if (ctx->owners || 0 == producers) {
+        return false;
+    }
+
+    hashtable_shard_owner *owners = calloc(ctx->count, sizeof(hashtable_shard_owner));
+    if (NULL == owners) {
+        return false;
+    }
+
+    size_t i;
+    for (i = 0; i < ctx->count; i++) {
+        if (0 != posix_memalign((void **)&owners[i].rings, HASHTABLE_SHARD_CACHELINE,
+                                producers * sizeof(hashtable_shard_ring))) {
+            owners[i].rings = NULL;
+            break;
+        }
+        memset(owners[i].rings, 0, producers * sizeof(hashtable_shard_ring));
+        if (0 != pthread_mutex_init(&owners[i].lock, NULL)) {
+            free(owners[i].rings);
+            owners[i].rings = NULL;
+            break;
+        }
+        if (0 != pthread_cond_init(&owners[i].wake, NULL)) {
+            pthread_mutex_destroy(&owners[i].lock);
+            free(owners[i].rings);
+            owners[i].rings = NULL;
+            break;
+        }
+        if (0 != pthread_cond_init(&owners[i].done, NULL)) {
+            pthread_cond_destroy(&owners[i].wake);
+            pthread_mutex_destroy(&owners[i].lock);
+            free(owners[i].rings);
+            owners[i].rings = NULL;
+            break;
+        }
+        owners[i].ctx = ctx;
+        owners[i].index = i;
+        owners[i].cpu = cpus ? cpus[i] : -1;
+    }
+
+    ctx->producers = producers;
+    ctx->owners = owners;
+
+    size_t started = 0;
+    if (i == ctx->count) {
+        for (started = 0; started < ctx->count; started++) {
+            if (0 != pthread_create(&owners[started].thread, NULL, hashtable_shard_owner_run, &owners[started])) {
+                break;
+            }
+        }
+    }
+
+    bool success = started == ctx->count;
+    for (i = 0; i < started; i++) {
+        while (!__atomic_load_n(&owners[i].ready, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&owners[i].failed, __ATOMIC_ACQUIRE)) {
+                success = false;
+                break;
+            }
+            sched_yield();
+        }
+    }
+
+    if (!success) {
+        for (i = 0; i < started; i++) {
+            hashtable_shard_owner_stop(&owners[i]);
+            pthread_join(owners[i].thread, NULL);
+        }
+        for (i = 0; i < ctx->count; i++) {
+            hashtable_shard_owner_free(&owners[i]);
+        }
+        free(owners);
+        ctx->owners = NULL;
+        ctx->producers = 0;
+        return false;
+    }
+
+    return true;
+}
+
+void hashtable_shard_stop(hashtable_shard_ctx *ctx) {
+    hashtable_shard_owner *owners = ctx->owners;
+    size_t i;
+
+    if (NULL == owners) {
+        return;
+    }
+
+    for (i = 0; i < ctx->count; i++) {
+        hashtable_shard_owner_stop(&owners[i]);
+    }
+    for (i = 0; i < ctx->count; i++) {
+        pthread_join(owners[i].thread, NULL);
+        hashtable_shard_owner_free(&owners[i]);
+    }
+    free(owners);
+
+    ctx->owners = NULL;
+    ctx->producers = 0;
+}
+
+bool hashtable_shard_submit(hashtable_shard_ctx *ctx, size_t producer, hashtable_shard_op *ops, size_t count) {
+    size_t i;
+
+    if (NULL == ctx->owners || producer >= ctx->producers) {
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        hashtable_shard_owner *owner = &ctx->owners[hashtable_shard_index(ctx, ops[i].key)];
+        hashtable_shard_ring *ring = &owner->rings[producer];
+        size_t tail = ring->tail;
+        size_t polls = 0;
+
+        ops[i].done = 0;
+        if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == HASHTABLE_SHARD_RING) {
+            // the owner may have parked before this batch filled its queue
+            hashtable_shard_wake(owner);
+            while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == HASHTABLE_SHARD_RING) {
+                if (!hashtable_shard_backoff(&polls)) {
+                    hashtable_shard_sleep(owner, &ring->head, tail - HASHTABLE_SHARD_RING);
+                }
+            }
+        }
+        ring->slots[tail & (HASHTABLE_SHARD_RING - 1)] = &ops[i];
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    for (i = 0; i < ctx->count; i++) {
+        hashtable_shard_wake(&ctx->owners[i]);
+    }
+
+    for (i = 0; i < count; i++) {
+        size_t polls = 0;
+
+        while (!__atomic_load_n(&ops[i].done, __ATOMIC_ACQUIRE)) {
+            if (hashtable_shard_backoff(&polls)) {
+                continue;
+            }
+            // an op is done before the owner moves the head past it, so wait
+            // for the head to move and look again
+            hashtable_shard_owner *owner = &ctx->owners[hashtable_shard_index(ctx, ops[i].key)];
+            hashtable_shard_ring *ring = &owner->rings[producer];
+            size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (!__atomic_load_n(&ops[i].done, __ATOMIC_ACQUIRE)) {
+                hashtable_shard_sleep(owner, &ring->head, head);
+            }
+        }
+    }
+
+    return true;
+}
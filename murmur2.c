@@ -1,23 +1,31 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MURMURHASH_X86 1
+#include <immintrin.h>
+#endif
 
 #define MURMURHASH_SEED 5381
 
-// https://github.com/aappleby/smhasher/blob/master/src/MurmurHash2.cpp
-static uint32_t MurmurHash2 (const void *key, size_t len) {
-    // 'm' and 'r' are mixing constants generated offline.
-    // They're not really 'magic', they just happen to work well.
-    #define m 0x5bd1e995
-    #define r 24
+// 'm' and 'r' are mixing constants generated offline.
+// They're not really 'magic', they just happen to work well.
+#define MURMURHASH_M 0x5bd1e995
+#define MURMURHASH_R 24
 
-    // Initialize the hash to a 'random' value
-    uint32_t h = MURMURHASH_SEED ^ len;
+// mix the 4 byte blocks and the last few bytes of data into h, then finalize.
+// lets a vector kernel hand over a key it has partly hashed
+static uint32_t MurmurHash2Finish (uint32_t h, const void *key, size_t len) {
+    const uint32_t m = MURMURHASH_M;
+    const int r = MURMURHASH_R;
 
     // Mix 4 bytes at a time into the hash
     const unsigned char * data = (const unsigned char *)key;
 
     while (len >= 4) {
-        uint32_t k = *(uint32_t *)data;
+        uint32_t k;
+        memcpy(&k, data, sizeof(k));
 
         k *= m;
         k ^= k >> r;
@@ -52,3 +60,149 @@ static uint32_t MurmurHash2 (const void *key, size_t len) {
 
     return h;
 }
+
+// https://github.com/aappleby/smhasher/blob/master/src/MurmurHash2.cpp
+static uint32_t MurmurHash2Seed (const void *key, size_t len, uint32_t seed) {
+    // Initialize the hash to a 'random' value
+    return MurmurHash2Finish(seed ^ len, key, len);
+}
+
+static uint32_t MurmurHash2 (const void *key, size_t len) {
+    return MurmurHash2Seed(key, len, MURMURHASH_SEED);
+}
+
+// Vector kernels hash one key per 32 bit lane. All lanes mix the blocks
+// every key has, then each lane finishes its own key with the scalar code,
+// so ragged lengths give the same hashes as MurmurHash2.
+
+// below this many shared blocks the scalar code is faster
+#define MURMURHASH_MIN_VECTOR_BLOCKS 2
+
+static size_t MurmurHash2SharedBlocks (const size_t *lens, size_t count) {
+    size_t blocks = lens[0] / 4;
+    size_t i;
+
+    for (i = 1; i < count; i++) {
+        if (lens[i] / 4 < blocks) {
+            blocks = lens[i] / 4;
+        }
+    }
+
+    return blocks;
+}
+
+static uint32_t MurmurHash2Load (const char *key, size_t block) {
+    uint32_t k;
+    memcpy(&k, key + block * 4, sizeof(k));
+    return k;
+}
+
+#ifdef MURMURHASH_X86
+__attribute__((target("avx2")))
+static void MurmurHash2Avx2 (const char *const *keys, const size_t *lens, uint32_t *out) {
+    size_t blocks = MurmurHash2SharedBlocks(lens, 8);
+    size_t b;
+    int i;
+
+    if (blocks < MURMURHASH_MIN_VECTOR_BLOCKS) {
+        for (i = 0; i < 8; i++) {
+            out[i] = MurmurHash2(keys[i], lens[i]);
+        }
+        return;
+    }
+
+    const __m256i m = _mm256_set1_epi32(MURMURHASH_M);
+    __m256i h = _mm256_setr_epi32(
+        MURMURHASH_SEED ^ (uint32_t)lens[0], MURMURHASH_SEED ^ (uint32_t)lens[1],
+        MURMURHASH_SEED ^ (uint32_t)lens[2], MURMURHASH_SEED ^ (uint32_t)lens[3],
+        MURMURHASH_SEED ^ (uint32_t)lens[4], MURMURHASH_SEED ^ (uint32_t)lens[5],
+        MURMURHASH_SEED ^ (uint32_t)lens[6], MURMURHASH_SEED ^ (uint32_t)lens[7]);
+
+    for (b = 0; b < blocks; b++) {
+        __m256i k = _mm256_setr_epi32(
+            MurmurHash2Load(keys[0], b), MurmurHash2Load(keys[1], b),
+            MurmurHash2Load(keys[2], b), MurmurHash2Load(keys[3], b),
+            MurmurHash2Load(keys[4], b), MurmurHash2Load(keys[5], b),
+            MurmurHash2Load(keys[6], b), MurmurHash2Load(keys[7], b));
+
+        k = _mm256_mullo_epi32(k, m);
+        k = _mm256_xor_si256(k, _mm256_srli_epi32(k, MURMURHASH_R));
+        k = _mm256_mullo_epi32(k, m);
+
+        h = _mm256_mullo_epi32(h, m);
+        h = _mm256_xor_si256(h, k);
+    }
+
+    _mm256_storeu_si256((__m256i *)out, h);
+    for (i = 0; i < 8; i++) {
+        out[i] = MurmurHash2Finish(out[i], keys[i] + blocks * 4, lens[i] - blocks * 4);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void MurmurHash2Avx512 (const char *const *keys, const size_t *lens, uint32_t *out) {
+    size_t blocks = MurmurHash2SharedBlocks(lens, 16);
+    uint32_t lanes[16];
+    size_t b;
+    int i;
+
+    if (blocks < MURMURHASH_MIN_VECTOR_BLOCKS) {
+        for (i = 0; i < 16; i++) {
+            out[i] = MurmurHash2(keys[i], lens[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < 16; i++) {
+        lanes[i] = MURMURHASH_SEED ^ (uint32_t)lens[i];
+    }
+    const __m512i m = _mm512_set1_epi32(MURMURHASH_M);
+    __m512i h = _mm512_loadu_si512(lanes);
+
+    for (b = 0; b < blocks; b++) {
+        __m512i k = _mm512_set_epi32(
+            MurmurHash2Load(keys[15], b), MurmurHash2Load(keys[14], b),
+            MurmurHash2Load(keys[13], b), MurmurHash2Load(keys[12], b),
+            MurmurHash2Load(keys[11], b), MurmurHash2Load(keys[10], b),
+            MurmurHash2Load(keys[9], b), MurmurHash2Load(keys[8], b),
+            MurmurHash2Load(keys[7], b), MurmurHash2Load(keys[6], b),
+            MurmurHash2Load(keys[5], b), MurmurHash2Load(keys[4], b),
+            MurmurHash2Load(keys[3], b), MurmurHash2Load(keys[2], b),
+            MurmurHash2Load(keys[1], b), MurmurHash2Load(keys[0], b));
+
+        k = _mm512_mullo_epi32(k, m);
+        k = _mm512_xor_si512(k, _mm512_srli_epi32(k, MURMURHASH_R));
+        k = _mm512_mullo_epi32(k, m);
+
+        h = _mm512_mullo_epi32(h, m);
+        h = _mm512_xor_si512(h, k);
+    }
+
+    _mm512_storeu_si512(lanes, h);
+    for (i = 0; i < 16; i++) {
+        out[i] = MurmurHash2Finish(lanes[i], keys[i] + blocks * 4, lens[i] - blocks * 4);
+    }
+}
+#endif
+
+// out[i] = MurmurHash2(keys[i], lens[i]), using the widest vector unit the cpu has
+static inline void MurmurHash2Batch (const char *const *keys, const size_t *lens, size_t count, uint32_t *out) {
+    size_t i = 0;
+
+#ifdef MURMURHASH_X86
+    if (__builtin_cpu_supports("avx512f")) {
+        for (; i + 16 <= count; i += 16) {
+            MurmurHash2Avx512(keys + i, lens + i, out + i);
+        }
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        for (; i + 8 <= count; i += 8) {
+            MurmurHash2Avx2(keys + i, lens + i, out + i);
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        out[i] = MurmurHash2(keys[i], lens[i]);
+    }
+}
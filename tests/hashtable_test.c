@@ -3,7 +3,10 @@
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "hashtable.h"
+#include "murmur2.c"
 #include "minunit.h"
 
 static char *rand_string() {
@@ -116,6 +119,960 @@ MU_TEST(hashtable_resize_test) {
     hashtable_destroy(ht);
 }
 
+MU_TEST(murmurhash2_batch_test) {
+    char buffers[100][64];
+    const char *keys[100];
+    size_t lens[100];
+    uint32_t hashes[100];
+    bool success = true;
+    size_t i;
+    size_t j;
+
+    // ragged lengths, including keys shorter than a block
+    for (i = 0; i < 100; i++) {
+        lens[i] = i < 50 ? (i * 7) % 64 : 40 + i % 3;
+        for (j = 0; j < lens[i]; j++) {
+            buffers[i][j] = (char)rand();
+        }
+        keys[i] = buffers[i];
+    }
+
+    MurmurHash2Batch(keys, lens, 100, hashes);
+    for (i = 0; i < 100; i++) {
+        success &= MurmurHash2(keys[i], lens[i]) == hashes[i];
+    }
+    mu_check(true == success);
+
+#ifdef MURMURHASH_X86
+    // the batch only uses the widest kernel the cpu has, check each one
+    if (__builtin_cpu_supports("avx2")) {
+        memset(hashes, 0, sizeof(hashes));
+        for (i = 0; i + 8 <= 100; i += 8) {
+            MurmurHash2Avx2(keys + i, lens + i, hashes + i);
+        }
+        for (i = 0; i < 96; i++) {
+            success &= MurmurHash2(keys[i], lens[i]) == hashes[i];
+        }
+        mu_check(true == success);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        memset(hashes, 0, sizeof(hashes));
+        for (i = 0; i + 16 <= 100; i += 16) {
+            MurmurHash2Avx512(keys + i, lens + i, hashes + i);
+        }
+        for (i = 0; i < 96; i++) {
+            success &= MurmurHash2(keys[i], lens[i]) == hashes[i];
+        }
+        mu_check(true == success);
+    }
+#endif
+}
+
+MU_TEST(hashtable_get_batch_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    char buffers[100][32];
+    const char *keys[100];
+    void *values[100];
+    bool success = true;
+    size_t i;
+
+    for (i = 0; i < 100; i++) {
+        snprintf(buffers[i], sizeof(buffers[i]), i % 2 ? "a long batched key %zu" : "k%zu", i);
+        keys[i] = buffers[i];
+        if (i % 3) {
+            hashtable_set(ht, keys[i], (void *)(i + 1));
+        }
+    }
+
+    hashtable_get_batch(ht, keys, 100, values);
+    for (i = 0; i < 100; i++) {
+        success &= values[i] == (i % 3 ? (void *)(i + 1) : NULL);
+    }
+    mu_check(true == success);
+
+    hashtable_bloom_filter(ht, true);
+    hashtable_get_batch(ht, keys + 1, 99, values);
+    for (i = 1; i < 100; i++) {
+        success &= values[i - 1] == (i % 3 ? (void *)(i + 1) : NULL);
+    }
+    mu_check(true == success);
+
+    hashtable_destroy(ht);
+}
+
+MU_TEST(hashtable_stats_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    hashtable_statistics stats;
+
+    hashtable_set(ht, "k1", (void *)1);
+    hashtable_set(ht, "k2", (void *)2);
+    hashtable_set(ht, "k3", (void *)3);
+    hashtable_set(ht, "k4", (void *)4);
+    hashtable_get(ht, "k1");
+    hashtable_get(ht, "k2");
+    hashtable_get(ht, "missing");
+
+    if (false == hashtable_stats(ht, &stats)) {
+        // built without --enable-stats
+        mu_check(NULL == ht->stats);
+        hashtable_destroy(ht);
+        return;
+    }
+
+    mu_check(3 == stats.gets);
+    mu_check(2 == stats.hits);
+    mu_check(1 == stats.misses);
+    mu_check(stats.probes >= 2);
+    mu_check(stats.max_probes >= 1);
+    mu_check(1 == stats.expansions);
+    mu_check(stats.bytes_allocated > ht->size * sizeof(hashtable_entry *));
+
+    size_t i;
+    size_t buckets = 0;
+    size_t entries = 0;
+    for (i = 0; i < HASHTABLE_STATS_CHAIN_SLOTS; i++) {
+        buckets += stats.chain_lengths[i];
+        entries += i * stats.chain_lengths[i];
+    }
+    mu_check(ht->size == buckets);
+    mu_check(4 == entries);
+
+    hashtable_delete(ht, "k1");
+    hashtable_delete(ht, "k2");
+    hashtable_delete(ht, "k3");
+    hashtable_delete(ht, "k4");
+    hashtable_stats(ht, &stats);
+    mu_check(sizeof(hashtable_ctx) + sizeof(hashtable_statistics) +
+             ht->size * sizeof(hashtable_entry *) == stats.bytes_allocated);
+
+    hashtable_destroy(ht);
+}
+
+typedef struct {
+    size_t blocks;
+    size_t bytes;
+} counting_allocator;
+
+static void *counting_malloc(void *ctx, size_t size) {
+    counting_allocator *counter = ctx;
+    __atomic_add_fetch(&counter->blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counter->bytes, size, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t oldSize, size_t size) {
+    counting_allocator *counter = ctx;
+    __atomic_add_fetch(&counter->bytes, size - oldSize, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+static void counting_free(void *ctx, void *ptr, size_t size) {
+    counting_allocator *counter = ctx;
+    __atomic_sub_fetch(&counter->blocks, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&counter->bytes, size, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+MU_TEST(hashtable_fork_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    hashtable_ctx *fork;
+
+    hashtable_set(ht, "k1", (void *)1);
+    hashtable_set(ht, "k2", (void *)2);
+    hashtable_set(ht, "k3", (void *)3);
+
+    fork = hashtable_fork(ht);
+    mu_check(NULL != fork);
+    mu_check(ht->table == fork->table);
+    mu_check(3 == fork->used);
+
+    // writes to one side are not seen by the other
+    mu_check(true == hashtable_set(ht, "k1", (void *)10));
+    mu_check(true == hashtable_delete(ht, "k2"));
+    mu_check(true == hashtable_set(ht, "k4", (void *)4));
+    mu_check(NULL != ht->overlay);
+    mu_check(NULL == fork->overlay);
+
+    mu_check((void *)10 == hashtable_get(ht, "k1"));
+    mu_check(NULL == hashtable_get(ht, "k2"));
+    mu_check((void *)1 == hashtable_get(fork, "k1"));
+    mu_check((void *)2 == hashtable_get(fork, "k2"));
+    mu_check(NULL == hashtable_get(fork, "k4"));
+    mu_check(3 == ht->used);
+    mu_check(3 == fork->used);
+
+    mu_check(true == hashtable_delete(fork, "k3"));
+    mu_check((void *)3 == hashtable_get(ht, "k3"));
+
+    // expanding copies what the table shares with the fork
+    mu_check(true == hashtable_expand(ht, 100));
+    mu_check(ht->table != fork->table);
+    mu_check((void *)10 == hashtable_get(ht, "k1"));
+    mu_check((void *)3 == hashtable_get(ht, "k3"));
+    mu_check((void *)2 == hashtable_get(fork, "k2"));
+
+    hashtable_destroy(ht);
+    mu_check((void *)1 == hashtable_get(fork, "k1"));
+    hashtable_destroy(fork);
+}
+
+MU_TEST(hashtable_fork_stats_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    hashtable_ctx *fork;
+    hashtable_statistics stats;
+    char key[16];
+    size_t i;
+
+    for (i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)(i + 1));
+    }
+    fork = hashtable_fork(ht);
+
+    if (false == hashtable_stats(ht, &stats)) {
+        // built without --enable-stats
+        hashtable_destroy(fork);
+        hashtable_destroy(ht);
+        return;
+    }
+
+    // the fork frees the entries the table allocated and copied
+    for (i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, NULL);
+        hashtable_delete(fork, key);
+    }
+    hashtable_stats(ht, &stats);
+    mu_check(sizeof(hashtable_ctx) + sizeof(hashtable_statistics) == stats.bytes_allocated);
+    hashtable_stats(fork, &stats);
+    mu_check(sizeof(hashtable_ctx) + sizeof(hashtable_statistics) == stats.bytes_allocated);
+    hashtable_destroy(fork);
+
+    // once alone, an insert folds the copied pages back into the buckets
+    hashtable_set(ht, "extra", NULL);
+    hashtable_delete(ht, "extra");
+    mu_check(NULL == ht->overlay);
+
+    // what is left are the buckets and entries of the table
+    size_t bytes = ht->size * sizeof(hashtable_entry *);
+    for (i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        bytes += sizeof(hashtable_entry) + strlen(key) + 1;
+    }
+    hashtable_stats(ht, &stats);
+    mu_check(bytes == stats.shared_bytes);
+
+    hashtable_destroy(ht);
+}
+
+#define FORK_PAGES_TEST_KEYS 50000
+
+MU_TEST(hashtable_fork_pages_test) {
+    counting_allocator counter = {0, 0};
+    hashtable_allocator allocator = {counting_malloc, NULL, counting_realloc, counting_free, &counter};
+    hashtable_ctx *ht = hashtable_new_with_allocator(FORK_PAGES_TEST_KEYS * 2, &allocator);
+    hashtable_ctx *fork;
+    char key[16];
+    bool success = true;
+    size_t changed = 0;
+    size_t blocks;
+    size_t size;
+    size_t i;
+
+    for (i = 0; i < FORK_PAGES_TEST_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)(i + 1));
+    }
+    fork = hashtable_fork(ht);
+    size = ht->size;
+    blocks = counter.blocks;
+
+    // the first write copies a single page of buckets and the entries on the way to its key
+    mu_check(true == hashtable_set(ht, "key1", NULL));
+    mu_check(ht->table == fork->table);
+    mu_check(counter.blocks - blocks < 10);
+    for (i = 0; i < size; i++) {
+        changed += hashtable_chain(ht, i) != hashtable_chain(fork, i);
+    }
+    mu_check(1 == changed);
+    mu_check((void *)2 == hashtable_get(fork, "key1"));
+
+    // growing copies whatever the table still shares
+    for (i = FORK_PAGES_TEST_KEYS; i < FORK_PAGES_TEST_KEYS * 2; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)(i + 1));
+    }
+    mu_check(ht->size > size);
+    mu_check(ht->table != fork->table);
+    mu_check(NULL == ht->overlay);
+    mu_check(size == fork->size);
+    mu_check(FORK_PAGES_TEST_KEYS == fork->used);
+    for (i = 2; i < FORK_PAGES_TEST_KEYS * 2; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)(i + 1) == hashtable_get(ht, key);
+        success &= (void *)(i < FORK_PAGES_TEST_KEYS ? i + 1 : 0) == hashtable_get(fork, key);
+    }
+    mu_check(true == success);
+    mu_check(NULL == hashtable_get(ht, "key1"));
+    mu_check((void *)2 == hashtable_get(fork, "key1"));
+
+    hashtable_destroy(fork);
+    hashtable_destroy(ht);
+    mu_check(0 == counter.blocks);
+}
+
+#define FORK_TEST_KEYS 5000
+
+static void *fork_reader_run(void *arg) {
+    hashtable_ctx *snapshot = arg;
+    char key[16];
+    size_t found = 0;
+    size_t i;
+
+    for (i = 0; i < FORK_TEST_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        if ((void *)(i + 1) == hashtable_get(snapshot, key)) {
+            found++;
+        }
+    }
+    hashtable_destroy(snapshot);
+
+    return (void *)found;
+}
+
+MU_TEST(hashtable_fork_concurrent_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    char key[16];
+    size_t i;
+
+    for (i = 0; i < FORK_TEST_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)(i + 1));
+    }
+
+    pthread_t reader;
+    void *found;
+    pthread_create(&reader, NULL, fork_reader_run, hashtable_fork(ht));
+
+    for (i = 0; i < FORK_TEST_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        if (i % 2) {
+            hashtable_delete(ht, key);
+        } else {
+            hashtable_set(ht, key, NULL);
+        }
+        snprintf(key, sizeof(key), "new%zu", i);
+        hashtable_set(ht, key, NULL);
+    }
+
+    pthread_join(reader, &found);
+    mu_check(FORK_TEST_KEYS == (size_t)found);
+    mu_check(FORK_TEST_KEYS + FORK_TEST_KEYS / 2 == ht->used);
+
+    hashtable_destroy(ht);
+}
+
+MU_TEST(hashtable_async_expand_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    char key[16];
+    bool success = true;
+    size_t i;
+
+    mu_check(true == hashtable_async_expand(ht, true));
+
+    for (i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= hashtable_set(ht, key, (void *)(i + 1));
+        if (i % 3 == 0) {
+            success &= hashtable_delete(ht, key);
+            success &= !hashtable_delete(ht, key);
+        }
+        snprintf(key, sizeof(key), "key%zu", i / 2);
+        success &= hashtable_get(ht, key) == ((i / 2) % 3 == 0 ? NULL : (void *)(i / 2 + 1));
+    }
+    mu_check(true == success);
+    mu_check(20000 - 6667 == ht->used);
+
+    // waits for the last expansion
+    mu_check(true == hashtable_async_expand(ht, false));
+    mu_check(NULL == ht->async);
+    mu_check(ht->size > 20000);
+    mu_check(20000 - 6667 == ht->used);
+
+    for (i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= hashtable_get(ht, key) == (i % 3 == 0 ? NULL : (void *)(i + 1));
+    }
+    mu_check(true == success);
+
+    // the replaced buckets were freed in the background, and counted
+    hashtable_statistics stats;
+    if (hashtable_stats(ht, &stats)) {
+        size_t bytes = sizeof(hashtable_ctx) + sizeof(hashtable_statistics) + ht->size * sizeof(hashtable_entry *);
+        for (i = 0; i < 20000; i++) {
+            snprintf(key, sizeof(key), "key%zu", i);
+            bytes += i % 3 == 0 ? 0 : sizeof(hashtable_entry) + strlen(key) + 1;
+        }
+        mu_check(bytes == stats.bytes_allocated);
+    }
+
+    hashtable_destroy(ht);
+
+    // gets never swap in a finished expansion, the next write does
+    ht = hashtable_new(5);
+    hashtable_async_expand(ht, true);
+    // the fourth key in five buckets starts an expansion
+    for (i = 0; i < 4; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)(i + 1));
+    }
+    size_t size = ht->size;
+    hashtable_entry **table = ht->table;
+    usleep(100000);
+    for (i = 0; i < 4; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)(i + 1) == hashtable_get(ht, key);
+    }
+    mu_check(true == success);
+    mu_check(size == ht->size);
+    mu_check(table == ht->table);
+    hashtable_set(ht, "last", NULL);
+    mu_check(ht->size > size);
+
+    hashtable_destroy(ht);
+}
+
+MU_TEST(hashtable_bloom_filter_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    hashtable_bloom_statistics stats;
+    char key[16];
+    bool success = true;
+    size_t i;
+
+    mu_check(false == hashtable_bloom_stats(ht, &stats));
+    hashtable_set(ht, "before", (void *)1);
+    mu_check(true == hashtable_bloom_filter(ht, true));
+    mu_check((void *)1 == hashtable_get(ht, "before"));
+
+    for (i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= hashtable_set(ht, key, (void *)(i + 1));
+    }
+    for (i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)(i + 1) == hashtable_get(ht, key);
+        snprintf(key, sizeof(key), "miss%zu", i);
+        success &= NULL == hashtable_get(ht, key);
+    }
+    mu_check(true == success);
+
+    mu_check(true == hashtable_bloom_stats(ht, &stats));
+    mu_check(stats.bytes > 0);
+    // the counters of gets are kept along with the table statistics
+    hashtable_statistics tableStats;
+    if (hashtable_stats(ht, &tableStats)) {
+        mu_check(10001 == stats.lookups);
+        mu_check(5000 == stats.negatives + stats.false_positives);
+        mu_check(stats.false_positive_rate < 0.05);
+    } else {
+        mu_check(0 == stats.lookups);
+    }
+
+    // deleted keys are gone even though they stay in the filter
+    for (i = 0; i < 5000; i += 2) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= hashtable_delete(ht, key);
+    }
+    for (i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= hashtable_get(ht, key) == (i % 2 ? (void *)(i + 1) : NULL);
+    }
+    mu_check(true == success);
+
+    // the fork shares the filter until it grows and rebuilds its own
+    hashtable_ctx *fork = hashtable_fork(ht);
+    hashtable_set(fork, "forked", (void *)2);
+    mu_check((void *)2 == hashtable_get(fork, "forked"));
+    mu_check(NULL == hashtable_get(ht, "forked"));
+    for (i = 5000; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= hashtable_set(fork, key, (void *)(i + 1));
+    }
+    mu_check(true == hashtable_set(ht, "parent", (void *)3));
+    for (i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= hashtable_get(fork, key) == (i < 5000 && i % 2 == 0 ? NULL : (void *)(i + 1));
+        success &= hashtable_get(ht, key) == (i < 5000 && i % 2 ? (void *)(i + 1) : NULL);
+    }
+    mu_check(true == success);
+    mu_check(NULL == hashtable_get(fork, "parent"));
+    mu_check((void *)3 == hashtable_get(ht, "parent"));
+    hashtable_destroy(fork);
+
+    mu_check(true == hashtable_bloom_filter(ht, false));
+    mu_check(false == hashtable_bloom_stats(ht, &stats));
+    mu_check((void *)2 == hashtable_get(ht, "key1"));
+
+    hashtable_destroy(ht);
+}
+
+MU_TEST(hashtable_bloom_filter_async_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    char key[16];
+    bool success = true;
+    size_t i;
+
+    hashtable_bloom_filter(ht, true);
+    hashtable_async_expand(ht, true);
+
+    for (i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= hashtable_set(ht, key, (void *)(i + 1));
+        snprintf(key, sizeof(key), "key%zu", i / 2);
+        success &= (void *)(i / 2 + 1) == hashtable_get(ht, key);
+    }
+    hashtable_async_expand(ht, false);
+    for (i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)(i + 1) == hashtable_get(ht, key);
+    }
+    mu_check(true == success);
+
+    hashtable_destroy(ht);
+}
+
+MU_TEST(hashtable_freeze_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    hashtable_frozen *frozen;
+    char key[16];
+    bool success = true;
+    size_t i;
+
+    frozen = hashtable_freeze(ht);
+    mu_check(0 == hashtable_frozen_used(frozen));
+    mu_check(NULL == hashtable_frozen_get(frozen, "key"));
+    hashtable_frozen_destroy(frozen);
+
+    for (i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)(i + 1));
+    }
+    hashtable_set(ht, "", (void *)20000);
+    hashtable_set(ht, "a key longer than a slot", (void *)20001);
+
+    frozen = hashtable_freeze(ht);
+    mu_check(NULL != frozen);
+    mu_check(10002 == hashtable_frozen_used(frozen));
+    hashtable_destroy(ht);
+
+    for (i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)(i + 1) == hashtable_frozen_get(frozen, key);
+        snprintf(key, sizeof(key), "miss%zu", i);
+        success &= NULL == hashtable_frozen_get(frozen, key);
+    }
+    mu_check(true == success);
+    mu_check((void *)20000 == hashtable_frozen_get(frozen, ""));
+    mu_check((void *)20001 == hashtable_frozen_get(frozen, "a key longer than a slot"));
+    mu_check(NULL == hashtable_frozen_get(frozen, "a key longer than a slo"));
+
+    char path[] = "/tmp/hashtable_frozen_XXXXXX";
+    int fd = mkstemp(path);
+    mu_check(fd >= 0);
+    close(fd);
+    mu_check(true == hashtable_frozen_save(frozen, path));
+    hashtable_frozen_destroy(frozen);
+
+    frozen = hashtable_frozen_load(path);
+    mu_check(NULL != frozen);
+    mu_check(10002 == hashtable_frozen_used(frozen));
+    mu_check((void *)20001 == hashtable_frozen_get(frozen, "a key longer than a slot"));
+    mu_check((void *)5000 == hashtable_frozen_get(frozen, "key4999"));
+    mu_check(NULL == hashtable_frozen_get(frozen, "key10000"));
+    hashtable_frozen_destroy(frozen);
+
+    // corrupted files: read the image, patch it and write it back. the
+    // header holds ten 64 bit fields after the magic, version and seed,
+    // the slots are 32 bytes with the length at 8 and the key offset at 16
+    FILE *fp = fopen(path, "rb");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    char *image = malloc(size);
+    fseek(fp, 0, SEEK_SET);
+    mu_check(1 == fread(image, size, 1, fp));
+    fclose(fp);
+
+    uint64_t field;
+    uint64_t slotsOffset;
+    memcpy(&slotsOffset, image + 64, sizeof(slotsOffset));
+    for (i = 0; i < 10002; i++) {
+        uint32_t slotKeyLen;
+        memcpy(&slotKeyLen, image + slotsOffset + i * 32 + 8, sizeof(slotKeyLen));
+        if (slotKeyLen > 16) {
+            field = UINT64_MAX - 8;
+            memcpy(image + slotsOffset + i * 32 + 16, &field, sizeof(field));
+        }
+    }
+    fp = fopen(path, "wb");
+    fwrite(image, size, 1, fp);
+    fclose(fp);
+    frozen = hashtable_frozen_load(path);
+    mu_check(NULL != frozen);
+    mu_check(NULL == hashtable_frozen_get(frozen, "a key longer than a slot"));
+    mu_check((void *)5000 == hashtable_frozen_get(frozen, "key4999"));
+    hashtable_frozen_destroy(frozen);
+
+    // a remapped position past the last slot
+    uint64_t remapOffset;
+    memcpy(&remapOffset, image + 56, sizeof(remapOffset));
+    field = 10002;
+    memcpy(image + remapOffset, &field, sizeof(field));
+    fp = fopen(path, "wb");
+    fwrite(image, size, 1, fp);
+    fclose(fp);
+    mu_check(NULL == hashtable_frozen_load(path));
+
+    // a bucket count whose pilots would wrap around the address space
+    field = ((uint64_t)1 << 62) + 1;
+    memcpy(image + 24, &field, sizeof(field));
+    fp = fopen(path, "wb");
+    fwrite(image, size, 1, fp);
+    fclose(fp);
+    mu_check(NULL == hashtable_frozen_load(path));
+    free(image);
+
+    fp = fopen(path, "r+b");
+    fputs("garbage", fp);
+    fclose(fp);
+    mu_check(NULL == hashtable_frozen_load(path));
+    unlink(path);
+}
+
+// more keys than the pilot search could once place, a few GB and half a
+// minute, so only run when HASHTABLE_TEST_LARGE is set
+#define FREEZE_LARGE_KEYS (((size_t)1 << 24) + ((size_t)1 << 20))
+
+MU_TEST(hashtable_freeze_large_test) {
+    hashtable_ctx *ht;
+    hashtable_frozen *frozen;
+    char key[16];
+    bool success = true;
+    size_t i;
+
+    if (NULL == getenv("HASHTABLE_TEST_LARGE")) {
+        return;
+    }
+
+    ht = hashtable_new(FREEZE_LARGE_KEYS);
+    for (i = 0; i < FREEZE_LARGE_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)(i + 1));
+    }
+
+    frozen = hashtable_freeze(ht);
+    hashtable_destroy(ht);
+    mu_check(NULL != frozen);
+    mu_check(FREEZE_LARGE_KEYS == hashtable_frozen_used(frozen));
+
+    for (i = 0; i < FREEZE_LARGE_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)(i + 1) == hashtable_frozen_get(frozen, key);
+    }
+    mu_check(true == success);
+    mu_check(NULL == hashtable_frozen_get(frozen, "miss"));
+    hashtable_frozen_destroy(frozen);
+}
+
+MU_TEST(hashtable_shard_test) {
+    hashtable_shard_ctx *ht = hashtable_shard_new(3, 5);
+    mu_check(4 == ht->count);
+
+    mu_check(true == hashtable_shard_set(ht, "k1", (void *)1));
+    mu_check(true == hashtable_shard_set(ht, "k2", (void *)2));
+    mu_check((void *)1 == hashtable_shard_get(ht, "k1"));
+    mu_check(2 == hashtable_shard_used(ht));
+    mu_check(true == hashtable_shard_delete(ht, "k1"));
+    mu_check(NULL == hashtable_shard_get(ht, "k1"));
+
+    hashtable_shard_destroy(ht);
+}
+
+#define SHARD_TEST_KEYS 1000
+
+typedef struct {
+    hashtable_shard_ctx *ht;
+    size_t producer;
+    char keys[SHARD_TEST_KEYS][16];
+    hashtable_shard_op ops[SHARD_TEST_KEYS];
+    bool success;
+} shard_producer;
+
+static void *shard_producer_run(void *arg) {
+    shard_producer *p = arg;
+    size_t i;
+
+    for (i = 0; i < SHARD_TEST_KEYS; i++) {
+        snprintf(p->keys[i], sizeof(p->keys[i]), "p%zu-%zu", p->producer, i);
+        p->ops[i].type = HASHTABLE_SHARD_SET;
+        p->ops[i].key = p->keys[i];
+        p->ops[i].value = (void *)(i + 1);
+    }
+    p->success = hashtable_shard_submit(p->ht, p->producer, p->ops, SHARD_TEST_KEYS);
+
+    for (i = 0; i < SHARD_TEST_KEYS; i++) {
+        p->ops[i].type = HASHTABLE_SHARD_GET;
+        p->ops[i].value = NULL;
+    }
+    p->success &= hashtable_shard_submit(p->ht, p->producer, p->ops, SHARD_TEST_KEYS);
+    for (i = 0; i < SHARD_TEST_KEYS; i++) {
+        p->success &= p->ops[i].success && (void *)(i + 1) == p->ops[i].value;
+        p->ops[i].type = HASHTABLE_SHARD_DELETE;
+    }
+
+    // delete the first half of the keys
+    p->success &= hashtable_shard_submit(p->ht, p->producer, p->ops, SHARD_TEST_KEYS / 2);
+
+    return NULL;
+}
+
+MU_TEST(hashtable_shard_owned_test) {
+    hashtable_shard_ctx *ht = hashtable_shard_new(4, 5);
+    shard_producer *producers = calloc(2, sizeof(shard_producer));
+    hashtable_shard_op op = {HASHTABLE_SHARD_GET, "early", NULL, false, 0};
+
+    hashtable_shard_set(ht, "early", (void *)7);
+    hashtable_bloom_filter(ht->shards[0], true);
+    hashtable_async_expand(ht->shards[1], true);
+    mu_check(false == hashtable_shard_submit(ht, 0, &op, 1));
+    mu_check(true == hashtable_shard_start(ht, 2, NULL));
+    mu_check(false == hashtable_shard_start(ht, 2, NULL));
+    mu_check(false == hashtable_shard_submit(ht, 2, &op, 1));
+
+    // entries set before start are moved to the owners
+    mu_check(true == hashtable_shard_submit(ht, 0, &op, 1));
+    mu_check(true == op.success);
+    mu_check((void *)7 == op.value);
+
+    pthread_t threads[2];
+    size_t i;
+    for (i = 0; i < 2; i++) {
+        producers[i].ht = ht;
+        producers[i].producer = i;
+        pthread_create(&threads[i], NULL, shard_producer_run, &producers[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        mu_check(true == producers[i].success);
+    }
+
+    // idle owners park instead of polling, and wake for the next op
+    struct timespec cpu0;
+    struct timespec cpu1;
+    usleep(50000);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+    usleep(200000);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+    mu_check((cpu1.tv_sec - cpu0.tv_sec) * 1000000000L + cpu1.tv_nsec - cpu0.tv_nsec < 50000000L);
+    mu_check(true == hashtable_shard_submit(ht, 0, &op, 1));
+    mu_check((void *)7 == op.value);
+
+    hashtable_shard_stop(ht);
+    // the shards rebuilt by their owners keep their settings
+    mu_check(NULL != ht->shards[0]->bloom);
+    mu_check(NULL != ht->shards[1]->async);
+    mu_check(1 + SHARD_TEST_KEYS == hashtable_shard_used(ht));
+    mu_check((void *)SHARD_TEST_KEYS == hashtable_shard_get(ht, "p1-999"));
+    mu_check(NULL == hashtable_shard_get(ht, "p1-0"));
+
+    hashtable_shard_destroy(ht);
+    free(producers);
+}
+
+MU_TEST(hashtable_allocator_test) {
+    counting_allocator counter = {0, 0};
+    hashtable_allocator allocator = {counting_malloc, NULL, counting_realloc, counting_free, &counter};
+    hashtable_ctx *ht = hashtable_new_with_allocator(5, &allocator);
+    char key[32];
+    bool success = true;
+    size_t i;
+
+    mu_check(1 == counter.blocks);
+    mu_check(5 * sizeof(hashtable_entry *) == counter.bytes);
+
+    for (i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)(i + 1));
+    }
+    mu_check(1001 == counter.blocks);
+
+    // a fork shares the allocator, and the entries it copies come from it
+    hashtable_ctx *fork = hashtable_fork(ht);
+    hashtable_set(fork, "key1", (void *)7);
+    hashtable_delete(ht, "key2");
+    hashtable_resize(ht);
+    hashtable_async_expand(fork, true);
+    for (i = 1000; i < 2000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(fork, key, (void *)(i + 1));
+    }
+    hashtable_destroy(ht);
+    for (i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)(1 == i ? 7 : i + 1) == hashtable_get(fork, key);
+    }
+    mu_check(true == success);
+
+    // shrinking moves the entries within the same array
+    for (i = 3; i < 2000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_delete(fork, key);
+    }
+    hashtable_async_expand(fork, false);
+    mu_check(true == hashtable_expand(fork, 11));
+    mu_check(11 == fork->size);
+    mu_check((void *)7 == hashtable_get(fork, "key1"));
+    mu_check((void *)3 == hashtable_get(fork, "key2"));
+    hashtable_destroy(fork);
+
+    mu_check(0 == counter.blocks);
+    mu_check(0 == counter.bytes);
+}
+
+MU_TEST(hashtable_hugepage_test) {
+    hashtable_allocator *allocator = hashtable_hugepage_new(HASHTABLE_HUGEPAGE_2MB);
+    hashtable_hugepage_statistics stats;
+    char key[32];
+    bool success = true;
+    size_t i;
+
+    mu_check(NULL == hashtable_hugepage_new(4096));
+    mu_check(NULL == hashtable_hugepage_new(3 * HASHTABLE_HUGEPAGE_2MB));
+    mu_check(NULL != allocator);
+
+    // a large block keeps its content when it grows, mapped either way
+    char *block = allocator->malloc(allocator->ctx, HASHTABLE_HUGEPAGE_2MB);
+    mu_check(NULL != block);
+    memset(block, 'x', HASHTABLE_HUGEPAGE_2MB);
+    block = allocator->realloc(allocator->ctx, block, HASHTABLE_HUGEPAGE_2MB, 3 * HASHTABLE_HUGEPAGE_2MB);
+    mu_check(NULL != block);
+    mu_check('x' == block[HASHTABLE_HUGEPAGE_2MB - 1]);
+    block[3 * HASHTABLE_HUGEPAGE_2MB - 1] = 'y';
+    hashtable_hugepage_stats(allocator, &stats);
+    mu_check(1 == stats.hugetlb_mappings + stats.madvise_mappings);
+    mu_check(3 * HASHTABLE_HUGEPAGE_2MB == stats.mapped_bytes);
+    allocator->free(allocator->ctx, block, 3 * HASHTABLE_HUGEPAGE_2MB);
+
+    // small blocks are recycled by size
+    void *small = allocator->malloc(allocator->ctx, 40);
+    allocator->free(allocator->ctx, small, 40);
+    mu_check(small == allocator->malloc(allocator->ctx, 33));
+    memset(small, 'x', 33);
+    allocator->free(allocator->ctx, small, 33);
+    char *zeroed = allocator->calloc(allocator->ctx, 40);
+    mu_check(small == zeroed && 0 == zeroed[0] && 0 == zeroed[39]);
+    allocator->free(allocator->ctx, zeroed, 40);
+
+    hashtable_ctx *ht = hashtable_new_with_allocator(5, allocator);
+    for (i = 0; i < 300000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)(i + 1));
+    }
+    // too long for the small blocks, so the entry comes from malloc
+    char *longKey = malloc(HASHTABLE_HUGEPAGE_SMALL + 1);
+    memset(longKey, 'k', HASHTABLE_HUGEPAGE_SMALL);
+    longKey[HASHTABLE_HUGEPAGE_SMALL] = '\0';
+    hashtable_set(ht, longKey, (void *)1);
+    mu_check((void *)1 == hashtable_get(ht, longKey));
+    free(longKey);
+    for (i = 0; i < 300000; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)(i + 1) == hashtable_get(ht, key);
+    }
+    mu_check(true == success);
+
+    // the bucket array is now large enough to be mapped on its own
+    hashtable_hugepage_stats(allocator, &stats);
+    mu_check(ht->size * sizeof(hashtable_entry *) >= HASHTABLE_HUGEPAGE_2MB);
+    mu_check(stats.mapped_bytes > stats.chunk_bytes);
+    mu_check(stats.chunk_bytes >= 300000 * 32);
+
+    hashtable_destroy(ht);
+    hashtable_hugepage_stats(allocator, &stats);
+    mu_check(stats.mapped_bytes == stats.chunk_bytes);
+    hashtable_hugepage_destroy(allocator);
+}
+
+#define PARALLEL_TEST_KEYS 20000
+
+static void parallel_sum(const char *key, void *value, void *arg) {
+    __atomic_add_fetch((size_t *)arg, (size_t)value, __ATOMIC_RELAXED);
+}
+
+static bool parallel_keep_odd(const char *key, void *value, void *arg) {
+    return (size_t)value % 2;
+}
+
+static void *parallel_add(const char *key, void *dst_value, void *src_value, void *arg) {
+    return (void *)((size_t)dst_value + (size_t)src_value);
+}
+
+MU_TEST(hashtable_parallel_test) {
+    hashtable_ctx *ht = hashtable_new(5);
+    hashtable_ctx *other = hashtable_new(5);
+    char key[32];
+    bool success = true;
+    size_t sum = 0;
+    size_t i;
+
+    for (i = 1; i <= PARALLEL_TEST_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(ht, key, (void *)i);
+    }
+    hashtable_bloom_filter(ht, true);
+
+    mu_check(true == hashtable_parallel_foreach(ht, parallel_sum, &sum, 4));
+    mu_check((size_t)PARALLEL_TEST_KEYS * (PARALLEL_TEST_KEYS + 1) / 2 == sum);
+
+    // the fork keeps every key the filter deletes
+    hashtable_ctx *fork = hashtable_fork(ht);
+    mu_check(true == hashtable_filter(ht, parallel_keep_odd, NULL, 4));
+    mu_check(PARALLEL_TEST_KEYS / 2 == ht->used);
+    mu_check(PARALLEL_TEST_KEYS == fork->used);
+    for (i = 1; i <= PARALLEL_TEST_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)(i % 2 ? i : 0) == hashtable_get(ht, key);
+        success &= (void *)i == hashtable_get(fork, key);
+    }
+    mu_check(true == success);
+
+    // half of the keys are in both tables
+    for (i = PARALLEL_TEST_KEYS / 2; i <= PARALLEL_TEST_KEYS * 2; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        hashtable_set(other, key, (void *)i);
+    }
+    mu_check(false == hashtable_merge(ht, ht, NULL, NULL, 4));
+    mu_check(true == hashtable_merge(ht, other, parallel_add, NULL, 4));
+    // 10000 odd keys, 30001 keys, 5000 odd keys in both
+    mu_check(35001 == ht->used);
+    for (i = 1; i <= PARALLEL_TEST_KEYS * 2; i++) {
+        size_t expected = i < PARALLEL_TEST_KEYS / 2 ? (i % 2 ? i : 0) :
+            i > PARALLEL_TEST_KEYS ? i : (i % 2 ? 2 * i : i);
+        snprintf(key, sizeof(key), "key%zu", i);
+        success &= (void *)expected == hashtable_get(ht, key);
+    }
+    mu_check(true == success);
+
+    // src wins without a conflict function, also into a forked table
+    mu_check(true == hashtable_merge(fork, other, NULL, NULL, 0));
+    mu_check((void *)(PARALLEL_TEST_KEYS / 2) == hashtable_get(fork, "key10000"));
+    mu_check((void *)1 == hashtable_get(fork, "key1"));
+    mu_check(PARALLEL_TEST_KEYS * 2 == fork->used);
+
+    hashtable_destroy(ht);
+    hashtable_destroy(other);
+    hashtable_destroy(fork);
+}
+
 MU_TEST(hashtable_set_get_delete_random) {
     hashtable_ctx *ht = hashtable_new(100);
 
@@ -158,6 +1115,37 @@ int main() {
 
     MU_RUN_TEST(hashtable_resize_test);
 
+    MU_RUN_TEST(murmurhash2_batch_test);
+
+    MU_RUN_TEST(hashtable_get_batch_test);
+
+    MU_RUN_TEST(hashtable_stats_test);
+
+    MU_RUN_TEST(hashtable_fork_test);
+    MU_RUN_TEST(hashtable_fork_stats_test);
+    MU_RUN_TEST(hashtable_fork_pages_test);
+
+    MU_RUN_TEST(hashtable_fork_concurrent_test);
+
+    MU_RUN_TEST(hashtable_async_expand_test);
+
+    MU_RUN_TEST(hashtable_bloom_filter_test);
+
+    MU_RUN_TEST(hashtable_bloom_filter_async_test);
+
+    MU_RUN_TEST(hashtable_freeze_test);
+    MU_RUN_TEST(hashtable_freeze_large_test);
+
+    MU_RUN_TEST(hashtable_shard_test);
+
+    MU_RUN_TEST(hashtable_shard_owned_test);
+
+    MU_RUN_TEST(hashtable_allocator_test);
+
+    MU_RUN_TEST(hashtable_hugepage_test);
+
+    MU_RUN_TEST(hashtable_parallel_test);
+
     MU_RUN_TEST(hashtable_set_get_delete_random);
 
     MU_REPORT();